@@ -0,0 +1,385 @@
+/*
+ * Benchmarks for lib.c
+ *
+ * Runs the parsers and formatters over every frame of a candump log many
+ * times over and reports the time per frame.  The fast paths are timed
+ * next to the reference versions they replaced.  With -m the results are
+ * printed as one JSON object per line so they can be collected and
+ * compared between builds.
+ *
+ * -t checks the fast versions against the reference ones instead, the
+ * parsers on random and malformed input once for each vector kernel the
+ * CPU has, the formatters on random frames with every view.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <net/if.h>
+#include <linux/can.h>
+#include <linux/can/error.h>
+
+#include "lib.h"
+
+#define MAX_FRAMES 100000
+#define CHECK_INPUTS 200000 // Per kind of input and kernel
+#define ERR_CLASS_MASK 0x1FF // Error classes snprintf_can_error_frame() knows
+
+struct bench_frame {
+  char str[CL_CFSZ]; // As in the log, "123#1122"
+  char *data; // Hex data after the '#'
+  struct canfd_frame cf;
+  struct canfd_frame err; // Error frame made from the same bytes
+  int maxdlen;
+};
+
+struct bench_frame *frames;
+int nframes = 0;
+int rounds = 100;
+int machine = 0;
+char *log_file = "data/sample-can.log";
+char buf[CL_LONGCFSZ];
+volatile int sink; // Keeps the compiler from dropping the calls
+uint64_t rng = 0x9E3779B97F4A7C15ULL; // Fixed, a failure can be reproduced
+unsigned long mismatches = 0;
+FILE *devnull;
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int load_frames(char *fname) {
+  char line[256], ifname[IFNAMSIZ + 1], frame[200];
+  unsigned long sec, usec;
+  struct bench_frame *f;
+  int mtu;
+  FILE *fp;
+
+  fp = fopen(fname, "r");
+  if(!fp) {
+    perror(fname);
+    return -1;
+  }
+  frames = calloc(MAX_FRAMES, sizeof(*frames));
+  if(!frames) {
+    fclose(fp);
+    return -1;
+  }
+  while(nframes < MAX_FRAMES && fgets(line, sizeof(line), fp)) {
+    if(sscanf(line, "(%lu.%6lu) %16s %199s", &sec, &usec, ifname, frame) != 4) continue;
+    f = &frames[nframes];
+    mtu = parse_canframe(frame, &f->cf);
+    if(!mtu || strlen(frame) >= sizeof(f->str)) continue;
+    strcpy(f->str, frame);
+    f->data = strrchr(f->str, '#') + 1;
+    if(mtu == CANFD_MTU) f->data++; // Skip the flags
+    f->maxdlen = mtu == CANFD_MTU ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+    f->err = f->cf;
+    f->err.can_id = CAN_ERR_FLAG | (f->cf.can_id & ERR_CLASS_MASK);
+    f->err.len = CAN_ERR_DLC;
+    nframes++;
+  }
+  fclose(fp);
+  return nframes ? 0 : -1;
+}
+
+static void report(char *name, double start) {
+  double ns = (now_sec() - start) * 1e9 / ((double)rounds * nframes);
+
+  if(machine)
+    printf("{\"name\": \"%s\", \"ns_per_frame\": %.2f, \"frames_per_sec\": %.0f, \"frames\": %d, \"rounds\": %d}\n",
+           name, ns, 1e9 / ns, nframes, rounds);
+  else
+    printf("%-32s %8.1f ns/frame %12.0f frames/s\n", name, ns, 1e9 / ns);
+}
+
+/* Times body, run once per frame f, rounds times over */
+#define BENCH(name, body) do {                        \
+    double start = now_sec();                         \
+    struct bench_frame *f;                            \
+    int r, i;                                         \
+    for(r = 0; r < rounds; r++)                       \
+      for(i = 0; i < nframes; i++) {                  \
+        f = &frames[i];                               \
+        body;                                         \
+      }                                               \
+    report(name, start);                              \
+  } while(0)
+
+/* xorshift64* */
+static uint64_t next_rand() {
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return rng * 0x2545F4914F6CDD1DULL;
+}
+
+/* Any frame the formatters can print, classic or CAN FD */
+static int random_frame(struct canfd_frame *cf) {
+  int i, maxdlen = next_rand() % 2 ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+
+  memset(cf, 0, sizeof(*cf));
+  switch(next_rand() % 4) {
+    case 0:
+      cf->can_id = next_rand() & CAN_SFF_MASK;
+      break;
+    case 1:
+      cf->can_id = (next_rand() & CAN_EFF_MASK) | CAN_EFF_FLAG;
+      break;
+    case 2:
+      cf->can_id = (next_rand() & ERR_CLASS_MASK) | CAN_ERR_FLAG;
+      break;
+    default:
+      cf->can_id = (next_rand() & CAN_SFF_MASK) | CAN_RTR_FLAG;
+      break;
+  }
+  cf->len = next_rand() % (maxdlen + 1);
+  if(maxdlen == CANFD_MAX_DLEN) cf->flags = next_rand() & 0xF;
+  for(i = 0; i < cf->len; i++) cf->data[i] = next_rand();
+  return maxdlen;
+}
+
+/* Changes, inserts or deletes a character or cuts the string short,
+ * with characters around the edges of what the parsers accept
+ */
+static void mutate(char *s) {
+  static const char chars[] = "0123456789abcdefABCDEF#.Rrg/: @\x7f\x80\xff";
+  int len = strlen(s), pos = next_rand() % (len + 1);
+  char c = chars[next_rand() % (sizeof(chars) - 1)];
+
+  switch(next_rand() % 4) {
+    case 0:
+      if(pos < len) s[pos] = c;
+      break;
+    case 1:
+      if(len + 1 >= (int)CL_CFSZ) break;
+      memmove(s + pos + 1, s + pos, len - pos + 1);
+      s[pos] = c;
+      break;
+    case 2:
+      if(pos < len) memmove(s + pos, s + pos + 1, len - pos);
+      break;
+    default:
+      s[pos] = 0;
+      break;
+  }
+}
+
+static void check_parse(char *str, char *kernel) {
+  struct canfd_frame a, b;
+  int ra, rb;
+
+  ra = parse_canframe(str, &a);
+  rb = parse_canframe_ref(str, &b);
+  if(ra == rb && !memcmp(&a, &b, sizeof(a))) return;
+  printf("parse_canframe (%s) differs on \"%s\": %d vs %d\n", kernel, str, ra, rb);
+  mismatches++;
+}
+
+static void check_hex(char *str, int maxdlen, char *kernel) {
+  unsigned char a[CANFD_MAX_DLEN], b[CANFD_MAX_DLEN];
+  int ra, rb;
+
+  memset(a, 0xA5, sizeof(a));
+  memset(b, 0xA5, sizeof(b));
+  ra = hexstring2data(str, a, maxdlen);
+  rb = hexstring2data_ref(str, b, maxdlen);
+  if(ra == rb && !memcmp(a, b, sizeof(a))) return;
+  printf("hexstring2data (%s) differs on \"%s\": %d vs %d\n", kernel, str, ra, rb);
+  mismatches++;
+}
+
+/* Parsers against their references with the current kernel */
+static void check_parsers(char *kernel) {
+  static const char hex[] = "0123456789abcdefABCDEF";
+  struct canfd_frame cf;
+  char str[CL_CFSZ + 2], *p;
+  int i, n, maxdlen;
+
+  // Buffers are zeroed past the string, parse_canframe() peeks at cs[8]
+  for(i = 0; i < CHECK_INPUTS; i++) {
+    memset(str, 0, sizeof(str));
+    maxdlen = random_frame(&cf);
+    sprint_canframe_ref(str, &cf, next_rand() % 2, maxdlen);
+    if(next_rand() % 2)
+      for(p = str; *p; p++) *p = tolower(*p);
+    check_parse(str, kernel);
+    mutate(str);
+    check_parse(str, kernel);
+  }
+  for(i = 0; i < CHECK_INPUTS; i++) {
+    memset(str, 0, sizeof(str));
+    n = next_rand() % (2 * CANFD_MAX_DLEN + 3);
+    for(p = str; p < str + n; p++) *p = hex[next_rand() % (sizeof(hex) - 1)];
+    if(next_rand() % 4 == 0) mutate(str);
+    check_hex(str, next_rand() % 2 ? CANFD_MAX_DLEN : CAN_MAX_DLEN, kernel);
+  }
+}
+
+/* The fprint functions as they were, sprintf() based and unlocked */
+static void fprint_canframe_ref(FILE *stream, struct canfd_frame *cf, char *eol, int sep, int maxdlen) {
+  char line[CL_CFSZ];
+
+  sprint_canframe_ref(line, cf, sep, maxdlen);
+  fprintf(stream, "%s", line);
+  if(eol) fprintf(stream, "%s", eol);
+}
+
+static void fprint_long_canframe_ref(FILE *stream, struct canfd_frame *cf, char *eol, int view, int maxdlen) {
+  char line[CL_LONGCFSZ];
+
+  sprint_long_canframe_ref(line, cf, view, maxdlen);
+  fprintf(stream, "%s", line);
+  if((view & CANLIB_VIEW_ERROR) && (cf->can_id & CAN_ERR_FLAG)) {
+    snprintf_can_error_frame(line, sizeof(line), cf, "\n\t");
+    fprintf(stream, "\n\t%s", line);
+  }
+  if(eol) fprintf(stream, "%s", eol);
+}
+
+static void check_string(char *what, struct canfd_frame *cf, int arg, char *a, char *b, int len) {
+  if(!strcmp(a, b) && (len < 0 || len == (int)strlen(a))) return;
+  printf("%s differs on %X len %d flags %X with %X: \"%s\" (%d) vs \"%s\"\n",
+         what, cf->can_id, cf->len, cf->flags, arg, a, len, b);
+  mismatches++;
+}
+
+/* fmemopen() NUL terminates out when the stream is closed */
+static FILE *mem_stream(char *out, size_t size) {
+  FILE *stream = fmemopen(out, size, "w");
+
+  if(!stream) {
+    perror("fmemopen");
+    exit(1);
+  }
+  return stream;
+}
+
+/* Formatters against their references */
+static void check_formatters() {
+  static char a[4 * CL_LONGCFSZ], b[4 * CL_LONGCFSZ];
+  struct canfd_frame cf;
+  FILE *fa, *fb;
+  int i, sep, view, maxdlen;
+
+  for(i = 0; i < CHECK_INPUTS; i++) {
+    maxdlen = random_frame(&cf);
+    sep = next_rand() % 2;
+    view = next_rand() & (CANLIB_VIEW_ASCII | CANLIB_VIEW_BINARY | CANLIB_VIEW_SWAP |
+                          CANLIB_VIEW_ERROR | CANLIB_VIEW_INDENT_SFF);
+    sprint_canframe_ref(b, &cf, sep, maxdlen);
+    check_string("sprint_canframe", &cf, sep, a, b, sprint_canframe(a, &cf, sep, maxdlen));
+    sprint_long_canframe_ref(b, &cf, view, maxdlen);
+    check_string("sprint_long_canframe", &cf, view, a, b, sprint_long_canframe(a, &cf, view, maxdlen));
+    fa = mem_stream(a, sizeof(a));
+    fb = mem_stream(b, sizeof(b));
+    fprint_canframe(fa, &cf, "\n", sep, maxdlen);
+    fprint_canframe_ref(fb, &cf, "\n", sep, maxdlen);
+    fclose(fa);
+    fclose(fb);
+    check_string("fprint_canframe", &cf, sep, a, b, -1);
+    fa = mem_stream(a, sizeof(a));
+    fb = mem_stream(b, sizeof(b));
+    fprint_long_canframe(fa, &cf, "\n", view, maxdlen);
+    fprint_long_canframe_ref(fb, &cf, "\n", view, maxdlen);
+    fclose(fa);
+    fclose(fb);
+    check_string("fprint_long_canframe", &cf, view, a, b, -1);
+  }
+}
+
+/* Runs every check with each kernel the CPU has, returns the exit code */
+static int run_checks() {
+  static char *names[] = { "scalar", "sse2", "avx2" };
+  int level, got;
+
+  for(level = LIB_SIMD_AVX2; level >= LIB_SIMD_NONE; level--) {
+    got = lib_simd_level(level);
+    if(got != level) {
+      printf("%s: not supported here, skipped\n", names[level]);
+      continue;
+    }
+    check_parsers(names[level]);
+    printf("%s: %d frames and %d hex strings checked\n", names[level], 2 * CHECK_INPUTS, CHECK_INPUTS);
+  }
+  lib_simd_level(LIB_SIMD_AVX2);
+  // The formatters have no vector kernels
+  check_formatters();
+  printf("formatters: %d frames checked\n", CHECK_INPUTS);
+  if(mismatches) printf("%lu mismatches\n", mismatches);
+  return mismatches ? 1 : 0;
+}
+
+void usage(char *msg) {
+  if(msg) printf("%s\n", msg);
+  printf("Usage: lib_bench [options] [candump log]\n");
+  printf("\t-r\trounds over the log (default: %d)\n", rounds);
+  printf("\t-m\tmachine readable output, one JSON object per line\n");
+  printf("\t-t\tcheck the fast versions against the reference ones instead\n");
+  printf("\t-h\tThis help screen\n");
+  exit(msg ? 1 : 0);
+}
+
+int main(int argc, char *argv[]) {
+  struct canfd_frame cf;
+  unsigned char data[CANFD_MAX_DLEN];
+  int opt, check = 0;
+
+  while ((opt = getopt(argc, argv, "r:mth?")) != -1) {
+    switch(opt) {
+      case 'r':
+        rounds = atoi(optarg);
+        if(rounds < 1) usage("Rounds must be at least 1");
+        break;
+      case 'm':
+        machine = 1;
+        break;
+      case 't':
+        check = 1;
+        break;
+      case 'h':
+      case '?':
+      default:
+        usage(NULL);
+        break;
+    }
+  }
+  if(check) return run_checks();
+  if(optind < argc) log_file = argv[optind];
+  if(load_frames(log_file) < 0) usage("Could not load any frames");
+  if(!machine) printf("%d frames from %s, %d rounds\n", nframes, log_file, rounds);
+  // The fprint benchmarks time the stdio locking and writes, not a terminal
+  devnull = fopen("/dev/null", "w");
+  if(!devnull) {
+    perror("/dev/null");
+    return 1;
+  }
+
+  BENCH("parse_canframe", sink = parse_canframe(f->str, &cf));
+  BENCH("parse_canframe_ref", sink = parse_canframe_ref(f->str, &cf));
+  BENCH("hexstring2data", sink = hexstring2data(f->data, data, f->maxdlen));
+  BENCH("hexstring2data_ref", sink = hexstring2data_ref(f->data, data, f->maxdlen));
+  BENCH("sprint_canframe", sink = sprint_canframe(buf, &f->cf, 0, f->maxdlen));
+  BENCH("sprint_canframe_ref", sprint_canframe_ref(buf, &f->cf, 0, f->maxdlen));
+  BENCH("sprint_long_canframe", sink = sprint_long_canframe(buf, &f->cf, 0, f->maxdlen));
+  BENCH("sprint_long_canframe_ref", sprint_long_canframe_ref(buf, &f->cf, 0, f->maxdlen));
+  BENCH("sprint_long_canframe_ascii", sink = sprint_long_canframe(buf, &f->cf, CANLIB_VIEW_ASCII, f->maxdlen));
+  BENCH("sprint_long_canframe_ascii_ref", sprint_long_canframe_ref(buf, &f->cf, CANLIB_VIEW_ASCII, f->maxdlen));
+  BENCH("sprint_long_canframe_binary", sink = sprint_long_canframe(buf, &f->cf, CANLIB_VIEW_BINARY | CANLIB_VIEW_SWAP, f->maxdlen));
+  BENCH("sprint_long_canframe_binary_ref", sprint_long_canframe_ref(buf, &f->cf, CANLIB_VIEW_BINARY | CANLIB_VIEW_SWAP, f->maxdlen));
+  BENCH("fprint_canframe", fprint_canframe(devnull, &f->cf, "\n", 0, f->maxdlen));
+  BENCH("fprint_canframe_ref", fprint_canframe_ref(devnull, &f->cf, "\n", 0, f->maxdlen));
+  BENCH("fprint_long_canframe", fprint_long_canframe(devnull, &f->cf, "\n", 0, f->maxdlen));
+  BENCH("fprint_long_canframe_ref", fprint_long_canframe_ref(devnull, &f->cf, "\n", 0, f->maxdlen));
+  BENCH("snprintf_can_error_frame", snprintf_can_error_frame(buf, sizeof(buf), &f->err, NULL));
+  BENCH("can_dlc2len/can_len2dlc", sink = can_dlc2len(can_len2dlc(f->cf.len)));
+  fclose(devnull);
+  free(frames);
+  return 0;
+}
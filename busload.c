@@ -0,0 +1,266 @@
+/*
+ * Synthetic bus load generator
+ */
+
+#define _GNU_SOURCE // sendmmsg()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
+#include <net/if.h>
+#include <linux/can/raw.h>
+
+#include "busload.h"
+#include "timeutil.h"
+
+#define BL_BURST 64 // Max frames per sendmmsg()
+#define BL_TICK_NS 1000000 // Shortest sleep, frames due meanwhile go out together
+#define BL_MAX_BEHIND_NS 100000000 // Give up catching up after this long
+#define BL_RETRY_NS 100000 // Back off when the TX queue is full
+
+/* xorshift64*, rand() takes a lock on every call */
+static uint64_t next_rand(struct busload *bl) {
+  bl->rng ^= bl->rng >> 12;
+  bl->rng ^= bl->rng << 25;
+  bl->rng ^= bl->rng >> 27;
+  return bl->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static uint32_t draw(struct busload *bl, struct bl_dist *d) {
+  uint64_t n = next_rand(bl) % d->total;
+  int i;
+
+  for(i = 0; n > d->hi[i] - d->lo[i]; i++)
+    n -= d->hi[i] - d->lo[i] + 1;
+  return d->lo[i] + n;
+}
+
+/*
+ * Bits a classic frame takes on the wire, without stuff bits: SOF, ID,
+ * control, data, CRC, ACK, EOF and the 3 bit interframe space.
+ */
+static int frame_bits(struct canfd_frame *cf) {
+  return ((cf->can_id & CAN_EFF_FLAG) ? 67 : 47) + 8 * cf->len;
+}
+
+void busload_init(struct busload *bl) {
+  memset(bl, 0, sizeof(*bl));
+  bl->sock = bl->stop_fd = bl->timer_fd = -1;
+  bl->bitrate = BL_DEFAULT_BITRATE;
+  bl->ids.lo[0] = 0x001;
+  bl->ids.hi[0] = CAN_SFF_MASK;
+  bl->ids.count = 1;
+  bl->ids.total = CAN_SFF_MASK;
+  bl->lens.lo[0] = bl->lens.hi[0] = CAN_MAX_DLEN;
+  bl->lens.count = 1;
+  bl->lens.total = 1;
+  bl->rng = time(NULL) | 1;
+}
+
+int busload_parse_dist(struct bl_dist *d, char *spec, uint32_t max) {
+  unsigned long lo, hi;
+  char *p = spec, *end;
+
+  memset(d, 0, sizeof(*d));
+  while(*p) {
+    if(d->count == BL_MAX_RANGES) return -1;
+    lo = hi = strtoul(p, &end, 0);
+    if(end == p) return -1;
+    p = end;
+    if(*p == '-') {
+      p++;
+      hi = strtoul(p, &end, 0);
+      if(end == p) return -1;
+      p = end;
+    }
+    if(hi < lo || hi > max) return -1;
+    d->lo[d->count] = lo;
+    d->hi[d->count] = hi;
+    d->total += hi - lo + 1;
+    d->count++;
+    if(*p == ',') p++;
+    else if(*p) return -1;
+  }
+  return d->count ? 0 : -1;
+}
+
+int busload_exclude(struct busload *bl, canid_t id) {
+  if(bl->nexclude == BL_MAX_EXCLUDE) return -1;
+  bl->exclude[bl->nexclude++] = id;
+  return 0;
+}
+
+/* Fills cf with a random frame, returns -1 if it drew an excluded ID */
+static int make_frame(struct busload *bl, struct canfd_frame *cf) {
+  uint64_t r = 0;
+  int i;
+
+  memset(cf, 0, sizeof(*cf));
+  cf->can_id = draw(bl, &bl->ids);
+  if(cf->can_id > CAN_SFF_MASK) cf->can_id |= CAN_EFF_FLAG;
+  for(i = 0; i < bl->nexclude; i++)
+    if(cf->can_id == bl->exclude[i]) return -1;
+  cf->len = draw(bl, &bl->lens);
+  for(i = 0; i < cf->len; i++) {
+    if(i % 8 == 0) r = next_rand(bl);
+    cf->data[i] = r >> (8 * (i % 8));
+  }
+  return 0;
+}
+
+static void send_burst(struct busload *bl, struct mmsghdr *msgs, int *bits, int n) {
+  struct timespec backoff = { 0, BL_RETRY_NS };
+  int sent, i;
+
+  while(n > 0 && !atomic_load_explicit(&bl->stop, memory_order_relaxed)) {
+    sent = sendmmsg(bl->sock, msgs, n, MSG_DONTWAIT);
+    if(sent < 0) {
+      if(errno == ENOBUFS || errno == EAGAIN) {
+        nanosleep(&backoff, NULL);
+        continue;
+      }
+      if(errno == EINTR) continue;
+      bl->errors++;
+      perror("busload sendmmsg");
+      return;
+    }
+    for(i = 0; i < sent; i++)
+      bl->bits += bits[i];
+    bl->sent += sent;
+    msgs += sent;
+    bits += sent;
+    n -= sent;
+  }
+}
+
+static void *busload_thread(void *arg) {
+  struct busload *bl = arg;
+  struct canfd_frame frames[BL_BURST];
+  struct mmsghdr msgs[BL_BURST];
+  struct iovec iovs[BL_BURST];
+  int bits[BL_BURST];
+  double ns_per_bit = bl->load > 0 ? 1e9 / (bl->load * bl->bitrate) : 0;
+  uint64_t t0, now, next;
+  int n;
+
+  prctl(PR_SET_TIMERSLACK, 1UL);
+  memset(msgs, 0, sizeof(msgs));
+  t0 = next = mono_ns();
+  while(!atomic_load_explicit(&bl->stop, memory_order_relaxed)) {
+    now = mono_ns();
+    // Don't flood the bus to make up for a stall
+    if(now > next + BL_MAX_BEHIND_NS) next = now;
+    for(n = 0; n < BL_BURST && next <= now; ) {
+      if(make_frame(bl, &frames[n]) < 0) continue;
+      bits[n] = frame_bits(&frames[n]);
+      next += bl->fps > 0 ? 1e9 / bl->fps : bits[n] * ns_per_bit;
+      iovs[n].iov_base = &frames[n];
+      iovs[n].iov_len = CAN_MTU;
+      msgs[n].msg_hdr.msg_iov = &iovs[n];
+      msgs[n].msg_hdr.msg_iovlen = 1;
+      n++;
+    }
+    if(n) {
+      send_burst(bl, msgs, bits, n);
+      bl->bursts++;
+    }
+    if(next > now && wait_until(bl->timer_fd, bl->stop_fd, next > now + BL_TICK_NS ? next : now + BL_TICK_NS) < 0) break;
+  }
+  bl->elapsed_ns = mono_ns() - t0;
+  return NULL;
+}
+
+int busload_start(struct busload *bl, char *ifname) {
+  struct sockaddr_can addr;
+  struct ifreq ifr;
+  uint64_t excluded = 0;
+  canid_t id;
+  int i, j;
+
+  // Drawing would never end if every ID is excluded
+  for(i = 0; i < bl->nexclude; i++) {
+    for(j = 0; j < i && bl->exclude[j] != bl->exclude[i]; j++);
+    if(j < i) continue; // Counted already
+    // Only IDs past 11 bits are drawn as extended, others can't collide
+    id = bl->exclude[i] & CAN_EFF_MASK;
+    if(!(bl->exclude[i] & CAN_EFF_FLAG) != (id <= CAN_SFF_MASK)) continue;
+    for(j = 0; j < bl->ids.count; j++)
+      if(id >= bl->ids.lo[j] && id <= bl->ids.hi[j]) excluded++;
+  }
+  if(excluded >= bl->ids.total) {
+    printf("busload: every ID in the list is in use by the controls\n");
+    return -1;
+  }
+  bl->sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if(bl->sock < 0) {
+    perror("busload socket");
+    return -1;
+  }
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+  if(ioctl(bl->sock, SIOCGIFINDEX, &ifr) < 0) {
+    perror("busload SIOCGIFINDEX");
+    goto error;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  // We only send on this socket
+  setsockopt(bl->sock, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0);
+  if(bind(bl->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("busload bind");
+    goto error;
+  }
+  bl->stop_fd = eventfd(0, EFD_CLOEXEC);
+  bl->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if(bl->stop_fd < 0 || bl->timer_fd < 0) {
+    perror("busload eventfd/timerfd");
+    goto error;
+  }
+  atomic_store(&bl->stop, 0);
+  if(pthread_create(&bl->tid, NULL, busload_thread, bl) != 0) {
+    printf("Could not start the busload thread\n");
+    goto error;
+  }
+  return 0;
+
+error:
+  close(bl->sock);
+  if(bl->stop_fd >= 0) close(bl->stop_fd);
+  if(bl->timer_fd >= 0) close(bl->timer_fd);
+  bl->sock = bl->stop_fd = bl->timer_fd = -1;
+  return -1;
+}
+
+void busload_stop(struct busload *bl) {
+  uint64_t one = 1;
+
+  if(bl->stop_fd < 0) return;
+  atomic_store(&bl->stop, 1);
+  if(write(bl->stop_fd, &one, sizeof(one)) != sizeof(one)) perror("busload stop");
+  pthread_join(bl->tid, NULL);
+  close(bl->sock);
+  close(bl->stop_fd);
+  close(bl->timer_fd);
+  bl->sock = bl->stop_fd = bl->timer_fd = -1;
+}
+
+void busload_print_stats(struct busload *bl) {
+  double secs = bl->elapsed_ns / 1e9;
+
+  if(secs <= 0) return;
+  printf("Bus load: %lu frames in %lu bursts, %lu errors\n", bl->sent, bl->bursts, bl->errors);
+  if(bl->fps > 0)
+    printf("Bus load: target %.0f frames/s actual %.0f frames/s (%.1f%% of %lu bit/s)\n",
+           bl->fps, bl->sent / secs, 100.0 * bl->bits / secs / bl->bitrate, bl->bitrate);
+  else
+    printf("Bus load: target %.1f%% actual %.1f%% of %lu bit/s (%.0f frames/s)\n",
+           100.0 * bl->load, 100.0 * bl->bits / secs / bl->bitrate, bl->bitrate, bl->sent / secs);
+}
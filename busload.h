@@ -0,0 +1,88 @@
+/*
+ * Synthetic bus load generator
+ *
+ * Fills the bus with random frames from a background thread, either up to
+ * a share of a nominal bitrate or at a fixed number of frames per second.
+ * IDs and lengths are drawn from configurable distributions and frames due
+ * together go out in one sendmmsg() call.
+ */
+
+#ifndef ICSIM_BUSLOAD_H
+#define ICSIM_BUSLOAD_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <linux/can.h>
+
+#define BL_MAX_RANGES 64
+#define BL_MAX_EXCLUDE 16
+#define BL_DEFAULT_BITRATE 500000
+
+/* Values are drawn uniformly from all the ranges together, listing a value
+ * more than once makes it more likely
+ */
+struct bl_dist {
+  uint32_t lo[BL_MAX_RANGES];
+  uint32_t hi[BL_MAX_RANGES];
+  int count;
+  uint64_t total; // Number of values over all ranges
+};
+
+struct busload {
+  struct bl_dist ids;
+  struct bl_dist lens;
+  canid_t exclude[BL_MAX_EXCLUDE]; // IDs that are never generated
+  int nexclude;
+  double load; // Share of the bitrate to fill, 0.0 - 1.0
+  double fps; // Frames per second instead of a load if not 0
+  unsigned long bitrate; // Nominal bitrate the load is relative to
+  uint64_t rng;
+  int sock;
+  int stop_fd; // eventfd, wakes the thread up to stop
+  int timer_fd;
+  atomic_int stop;
+  pthread_t tid;
+  // Statistics, only valid once the thread is stopped
+  unsigned long sent;
+  unsigned long bursts;
+  unsigned long errors;
+  uint64_t bits; // Bits on the wire for the frames sent
+  uint64_t elapsed_ns;
+};
+
+void busload_init(struct busload *bl);
+/*
+ * Sets the defaults: standard IDs 0x001 - 0x7FF, 8 byte frames and a
+ * BL_DEFAULT_BITRATE bus.  Set load or fps before starting.
+ */
+
+int busload_parse_dist(struct bl_dist *d, char *spec, uint32_t max);
+/*
+ * Parses a comma separated list of values and lo-hi ranges, in decimal or
+ * 0x hex, Ex: "0x100-0x1ff,0x244" or "2,8,8,8".  Values above max are
+ * rejected.  Returns 0 on success, -1 on a malformed list.
+ */
+
+int busload_exclude(struct busload *bl, canid_t id);
+/*
+ * Keeps id out of the generated traffic, so it does not fight with the
+ * frames controls sends itself.  Extended IDs carry CAN_EFF_FLAG, like
+ * in a frame.  Returns -1 if the list is full.
+ */
+
+int busload_start(struct busload *bl, char *ifname);
+/*
+ * Opens a socket on ifname and starts the generator thread.
+ * Returns 0 on success, -1 on error.
+ */
+
+void busload_stop(struct busload *bl);
+/*
+ * Stops the generator thread and waits for it, safe to call if it was
+ * never started.
+ */
+
+void busload_print_stats(struct busload *bl);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Converts between candump logs and binary captures
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <net/if.h>
+#include <linux/can.h>
+
+#include "lib.h"
+#include "capture.h"
+
+char *ifname = NULL;
+double start_sec = 0; // Window to convert, from the first frame
+double end_sec = -1;
+
+/* Binary capture to candump log */
+int cap2log(char *in, char *out) {
+  struct cap_file cap;
+  struct cap_record *rec;
+  char buf[CL_CFSZ];
+  uint64_t i, end, first;
+  FILE *fp;
+
+  if(cap_open(&cap, in) < 0) return 1;
+  first = cap.records[0].ts_ns;
+  i = cap_seek(&cap, first + (uint64_t)(start_sec * 1e9));
+  end = end_sec < 0 ? cap.count : cap_seek(&cap, first + (uint64_t)(end_sec * 1e9));
+  // cap_open() refuses a log without frames, don't write one
+  if(i >= end) {
+    fprintf(stderr, "%s: no CAN frames in the selected window\n", in);
+    cap_close(&cap);
+    return 1;
+  }
+  fp = fopen(out, "w");
+  if(!fp) {
+    perror(out);
+    cap_close(&cap);
+    return 1;
+  }
+  for(; i < end; i++) {
+    rec = &cap.records[i];
+    sprint_canframe(buf, &rec->cf, 0, cap_mtu(rec) == CANFD_MTU ? CANFD_MAX_DLEN : CAN_MAX_DLEN);
+    fprintf(fp, "(%lu.%06lu) %s %s\n", (unsigned long)(rec->ts_ns / 1000000000ULL),
+            (unsigned long)(rec->ts_ns % 1000000000ULL / 1000), ifname ? ifname : cap.ifname, buf);
+  }
+  cap_close(&cap);
+  if(fclose(fp)) {
+    perror(out);
+    return 1;
+  }
+  return 0;
+}
+
+/* candump log to binary capture, streamed so logs of any size work */
+int log2cap(char *in, char *out) {
+  struct cap_writer w;
+  struct cap_record rec;
+  char line[256], iface[IFNAMSIZ];
+  uint64_t first = 0;
+  int ret = 0, started = 0;
+  FILE *fp;
+
+  fp = fopen(in, "r");
+  if(!fp) {
+    perror(in);
+    return 1;
+  }
+  while(fgets(line, sizeof(line), fp)) {
+    if(!cap_parse_line(line, &rec, iface)) continue;
+    if(!started) {
+      if(cap_create(&w, out, ifname ? ifname : iface) < 0) {
+        fclose(fp);
+        return 1;
+      }
+      first = rec.ts_ns;
+      started = 1;
+    }
+    if(rec.ts_ns < first + (uint64_t)(start_sec * 1e9)) continue;
+    if(end_sec >= 0 && rec.ts_ns >= first + (uint64_t)(end_sec * 1e9)) break;
+    if(cap_write(&w, &rec) < 0) {
+      ret = 1;
+      break;
+    }
+  }
+  fclose(fp);
+  if(!started) {
+    fprintf(stderr, "%s: no CAN frames found\n", in);
+    return 1;
+  }
+  if(cap_finish(&w) < 0) ret = 1;
+  // Nor a capture without records
+  if(!ret && !w.hdr.count) {
+    fprintf(stderr, "%s: no CAN frames in the selected window\n", in);
+    ret = 1;
+  }
+  if(ret) unlink(out);
+  return ret;
+}
+
+void usage(char *msg) {
+  if(msg) printf("%s\n", msg);
+  printf("Usage: capconv [options] <in> <out>\n");
+  printf("Converts a candump log to a binary capture, or a capture back to a log\n");
+  printf("\t-I\tinterface name to record (default: the one in the input)\n");
+  printf("\t-s\tstart at this many seconds after the first frame\n");
+  printf("\t-e\tstop at this many seconds after the first frame\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  char magic[sizeof(CAP_MAGIC) - 1];
+  int opt, is_cap;
+  FILE *fp;
+
+  while ((opt = getopt(argc, argv, "I:s:e:h?")) != -1) {
+    switch(opt) {
+	case 'I':
+		ifname = optarg;
+		break;
+	case 's':
+		start_sec = atof(optarg);
+		break;
+	case 'e':
+		end_sec = atof(optarg);
+		break;
+	case 'h':
+	case '?':
+	default:
+		usage(NULL);
+		break;
+    }
+  }
+  if (optind + 2 != argc) usage("You must give an input and an output file");
+
+  fp = fopen(argv[optind], "r");
+  if(!fp) {
+    perror(argv[optind]);
+    return 1;
+  }
+  is_cap = fread(magic, sizeof(magic), 1, fp) == 1 && !memcmp(magic, CAP_MAGIC, sizeof(magic));
+  fclose(fp);
+  if(is_cap) return cap2log(argv[optind], argv[optind + 1]);
+  return log2cap(argv[optind], argv[optind + 1]);
+}
@@ -0,0 +1,216 @@
+/*
+ * Binary CAN capture format
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <net/if.h>
+#include <linux/can.h>
+
+#include "lib.h"
+#include "capture.h"
+
+_Static_assert(sizeof(struct cap_header) == CAP_RECORDS_OFFSET, "capture header size");
+_Static_assert(sizeof(struct cap_record) == 88, "capture record size");
+
+int cap_parse_line(char *line, struct cap_record *rec, char *ifname) {
+  char iface[IFNAMSIZ], frame[200];
+  unsigned long sec, usec;
+  int mtu;
+
+  if(sscanf(line, "(%lu.%6lu) %15s %199s", &sec, &usec, iface, frame) != 4) return 0;
+  memset(rec, 0, sizeof(*rec));
+  mtu = parse_canframe(frame, &rec->cf);
+  if(!mtu) return 0;
+  rec->ts_ns = sec * 1000000000ULL + usec * 1000ULL;
+  if(mtu == CANFD_MTU) rec->flags = CAP_REC_FD;
+  if(ifname) strcpy(ifname, iface);
+  return mtu;
+}
+
+/* Parses a whole candump log into memory */
+static int load_log(struct cap_file *cap, FILE *fp, char *fname) {
+  struct cap_record *records;
+  char line[256];
+  uint64_t size = 0;
+
+  while(fgets(line, sizeof(line), fp)) {
+    if(cap->count == size) {
+      size = size ? size * 2 : 1024;
+      records = realloc(cap->records, size * sizeof(*records));
+      if(!records) {
+        fprintf(stderr, "%s: out of memory\n", fname);
+        return -1;
+      }
+      cap->records = records;
+    }
+    if(cap_parse_line(line, &cap->records[cap->count], cap->count ? NULL : cap->ifname))
+      cap->count++;
+  }
+  if(!cap->count) {
+    fprintf(stderr, "%s: no CAN frames found\n", fname);
+    return -1;
+  }
+  return 0;
+}
+
+/* Maps a capture file and checks it is complete */
+static int map_capture(struct cap_file *cap, int fd, char *fname) {
+  struct cap_header *hdr;
+  struct stat st;
+
+  if(fstat(fd, &st) < 0) {
+    perror(fname);
+    return -1;
+  }
+  cap->map_size = st.st_size;
+  if(cap->map_size < CAP_RECORDS_OFFSET) {
+    fprintf(stderr, "%s: truncated capture\n", fname);
+    return -1;
+  }
+  cap->map = mmap(NULL, cap->map_size, PROT_READ, MAP_SHARED, fd, 0);
+  if(cap->map == MAP_FAILED) {
+    cap->map = NULL;
+    perror(fname);
+    return -1;
+  }
+  hdr = cap->map;
+  if(hdr->version != CAP_VERSION || hdr->record_size != sizeof(struct cap_record)) {
+    fprintf(stderr, "%s: unsupported capture version or byte order\n", fname);
+    return -1;
+  }
+  if(hdr->count > (cap->map_size - CAP_RECORDS_OFFSET) / sizeof(struct cap_record) ||
+     hdr->index_offset < CAP_RECORDS_OFFSET + hdr->count * sizeof(struct cap_record) ||
+     hdr->index_offset > cap->map_size ||
+     hdr->index_count > (cap->map_size - hdr->index_offset) / sizeof(struct cap_index) ||
+     !hdr->count || !hdr->index_stride) {
+    fprintf(stderr, "%s: truncated or corrupt capture\n", fname);
+    return -1;
+  }
+  cap->records = (struct cap_record *)((char *)cap->map + CAP_RECORDS_OFFSET);
+  cap->count = hdr->count;
+  cap->index = (struct cap_index *)((char *)cap->map + hdr->index_offset);
+  cap->index_count = hdr->index_count;
+  cap->index_stride = hdr->index_stride;
+  memcpy(cap->ifname, hdr->ifname, sizeof(cap->ifname) - 1);
+  // We play it front to back
+  madvise(cap->map, cap->map_size, MADV_SEQUENTIAL);
+  return 0;
+}
+
+int cap_open(struct cap_file *cap, char *fname) {
+  char magic[sizeof(((struct cap_header *)0)->magic)];
+  FILE *fp;
+  int ret;
+
+  memset(cap, 0, sizeof(*cap));
+  fp = fopen(fname, "r");
+  if(!fp) {
+    perror(fname);
+    return -1;
+  }
+  if(fread(magic, sizeof(magic), 1, fp) == 1 && !memcmp(magic, CAP_MAGIC, sizeof(magic))) {
+    ret = map_capture(cap, fileno(fp), fname);
+  } else {
+    rewind(fp);
+    ret = load_log(cap, fp, fname);
+  }
+  fclose(fp);
+  if(ret < 0) cap_close(cap);
+  return ret;
+}
+
+void cap_close(struct cap_file *cap) {
+  if(cap->map) munmap(cap->map, cap->map_size);
+  else free(cap->records);
+  memset(cap, 0, sizeof(*cap));
+}
+
+uint64_t cap_seek(struct cap_file *cap, uint64_t ts_ns) {
+  uint64_t lo = 0, hi = cap->count, mid;
+
+  // Narrow down to one stride with the index, if there is one
+  if(cap->index_count) {
+    uint64_t ilo = 0, ihi = cap->index_count;
+    while(ilo < ihi) {
+      mid = ilo + (ihi - ilo) / 2;
+      if(cap->index[mid].ts_ns < ts_ns) ilo = mid + 1;
+      else ihi = mid;
+    }
+    // Entry ilo is the first at or after ts_ns, the answer is after the one before it
+    if(ilo > 0) lo = cap->index[ilo - 1].record + 1;
+    if(ilo < cap->index_count) hi = cap->index[ilo].record;
+  }
+  while(lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if(cap->records[mid].ts_ns < ts_ns) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+int cap_create(struct cap_writer *w, char *fname, char *ifname) {
+  memset(w, 0, sizeof(*w));
+  memcpy(w->hdr.magic, CAP_MAGIC, sizeof(w->hdr.magic));
+  w->hdr.version = CAP_VERSION;
+  w->hdr.record_size = sizeof(struct cap_record);
+  w->hdr.index_stride = CAP_INDEX_STRIDE;
+  if(ifname) strncpy(w->hdr.ifname, ifname, sizeof(w->hdr.ifname) - 1);
+  w->fp = fopen(fname, "w");
+  if(!w->fp) {
+    perror(fname);
+    return -1;
+  }
+  // Placeholder until cap_finish() knows the counts
+  if(fwrite(&w->hdr, sizeof(w->hdr), 1, w->fp) != 1) {
+    perror(fname);
+    fclose(w->fp);
+    return -1;
+  }
+  return 0;
+}
+
+int cap_write(struct cap_writer *w, struct cap_record *rec) {
+  struct cap_index *index;
+
+  if(w->hdr.count % CAP_INDEX_STRIDE == 0) {
+    if(w->hdr.index_count == w->index_size) {
+      w->index_size = w->index_size ? w->index_size * 2 : 256;
+      index = realloc(w->index, w->index_size * sizeof(*index));
+      if(!index) {
+        fprintf(stderr, "capture: out of memory\n");
+        return -1;
+      }
+      w->index = index;
+    }
+    w->index[w->hdr.index_count].ts_ns = rec->ts_ns;
+    w->index[w->hdr.index_count].record = w->hdr.count;
+    w->hdr.index_count++;
+  }
+  if(fwrite(rec, sizeof(*rec), 1, w->fp) != 1) {
+    perror("capture write");
+    return -1;
+  }
+  w->hdr.count++;
+  return 0;
+}
+
+int cap_finish(struct cap_writer *w) {
+  int ret = 0;
+
+  w->hdr.index_offset = CAP_RECORDS_OFFSET + w->hdr.count * sizeof(struct cap_record);
+  if(w->hdr.index_count && fwrite(w->index, sizeof(*w->index), w->hdr.index_count, w->fp) != w->hdr.index_count)
+    ret = -1;
+  if(ret == 0 && (fseek(w->fp, 0, SEEK_SET) < 0 || fwrite(&w->hdr, sizeof(w->hdr), 1, w->fp) != 1))
+    ret = -1;
+  if(fclose(w->fp)) ret = -1;
+  if(ret < 0) perror("capture finish");
+  free(w->index);
+  w->index = NULL;
+  return ret;
+}
@@ -0,0 +1,114 @@
+/*
+ * Binary CAN capture format
+ *
+ * A capture is a 64 byte header, fixed size records and a sparse time
+ * index, all in host byte order:
+ *
+ *   struct cap_header
+ *   struct cap_record[count]     starting at CAP_RECORDS_OFFSET
+ *   struct cap_index[index_count] at index_offset
+ *
+ * Each record embeds a ready to send struct canfd_frame, so a mapped
+ * capture can be handed to the socket without copying.  The index holds
+ * the timestamp of every index_stride'th record, it narrows a seek down to
+ * a few pages before the records themselves are binary searched.
+ * Records must be in timestamp order for seeking to work.
+ */
+
+#ifndef ICSIM_CAPTURE_H
+#define ICSIM_CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <linux/can.h>
+
+#define CAP_MAGIC "ICSIMCAP"
+#define CAP_VERSION 2
+#define CAP_RECORDS_OFFSET 64
+#define CAP_INDEX_STRIDE 1024
+#define CAP_REC_FD 0x1 // In flags: CAN FD frame
+
+struct cap_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t count;
+  uint64_t index_offset;
+  uint64_t index_count;
+  uint64_t index_stride;
+  char ifname[16]; // Interface the frames were captured on
+};
+
+struct cap_record {
+  uint64_t ts_ns; // Nanoseconds since the epoch
+  uint32_t flags; // CAP_REC_*
+  uint32_t reserved;
+  struct canfd_frame cf; // Sent as is, so nothing of ours goes in it
+};
+
+struct cap_index {
+  uint64_t ts_ns;
+  uint64_t record;
+};
+
+/* A capture being read, either mapped from a capture file or parsed
+ * into memory from a candump log
+ */
+struct cap_file {
+  struct cap_record *records;
+  uint64_t count;
+  struct cap_index *index;
+  uint64_t index_count;
+  uint64_t index_stride;
+  char ifname[16];
+  void *map; // NULL if records were malloc()ed
+  size_t map_size;
+};
+
+/* Capture being written */
+struct cap_writer {
+  FILE *fp;
+  struct cap_header hdr;
+  struct cap_index *index;
+  uint64_t index_size;
+};
+
+static inline int cap_mtu(const struct cap_record *r) {
+  return (r->flags & CAP_REC_FD) ? CANFD_MTU : CAN_MTU;
+}
+
+int cap_parse_line(char *line, struct cap_record *rec, char *ifname);
+/*
+ * Parses one candump log line, "(1398128223.803317) can0 166#D0320009",
+ * into rec.  ifname (IFNAMSIZ bytes) receives the interface if not NULL.
+ * Returns the frame's MTU or 0 if the line is not a valid frame.
+ */
+
+int cap_open(struct cap_file *cap, char *fname);
+/*
+ * Opens a capture or candump log for reading.  Captures are mapped,
+ * logs are parsed into memory.
+ *
+ * Return values:
+ * 0 = success
+ * -1 = error, reported on stderr
+ */
+
+void cap_close(struct cap_file *cap);
+
+uint64_t cap_seek(struct cap_file *cap, uint64_t ts_ns);
+/*
+ * Returns the index of the first record at or after ts_ns, cap->count if
+ * there is none.  O(log n).
+ */
+
+int cap_create(struct cap_writer *w, char *fname, char *ifname);
+int cap_write(struct cap_writer *w, struct cap_record *rec);
+int cap_finish(struct cap_writer *w);
+/*
+ * Write a capture: create it, add records in timestamp order and finish
+ * it to write the index and header.  All return 0 on success and -1 on
+ * error, reported on stderr.
+ */
+
+#endif
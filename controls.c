@@ -9,8 +9,11 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <getopt.h>
+#include <errno.h>
 #include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <stdatomic.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
@@ -20,6 +23,13 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 
+#include "lib.h"
+#include "replay.h"
+#include "busload.h"
+#include "cyclic.h"
+#include "signals.h"
+#include "timeutil.h"
+
 #ifndef DATA_DIR
 #define DATA_DIR "./data/"
 #endif
@@ -29,12 +39,6 @@
 // 0 = No randomization added to the packets other than location and ID
 // 1 = Add NULL padding
 // 2 = Randomize unused bytes
-#define DEFAULT_DOOR_ID 411
-#define DEFAULT_DOOR_POS 2
-#define DEFAULT_SIGNAL_ID 392
-#define DEFAULT_SIGNAL_POS 0
-#define DEFAULT_SPEED_ID 580
-#define DEFAULT_SPEED_POS 3
 #define CAN_DOOR1_LOCK 1
 #define CAN_DOOR2_LOCK 2 
 #define CAN_DOOR3_LOCK 4
@@ -79,13 +83,15 @@
 #define PS3_Z_ROT 6 // The rotations are just guessed
 #define MAX_SPEED 90.0 // Limiter 260.0 is full guage speed
 #define ACCEL_RATE 8.0 // 0-MAX_SPEED in seconds
+#define SPEED_PERIOD_MS 10 // Speed is updated and sent this often
+#define SIGNAL_PERIOD_MS 500 // Turn signals blink at this rate
+#define MIN_PERIOD_NS 1000 // Shortest cyclic period -A may scale down to
+#define MAX_SCENARIO_STEPS 4096
+#define ALL_DOORS (CAN_DOOR1_LOCK | CAN_DOOR2_LOCK | CAN_DOOR3_LOCK | CAN_DOOR4_LOCK)
 #define USB_CONTROLLER 0
 #define PS3_CONTROLLER 1
 
-// For now, specific models will be done as constants.  Later
-// We should use a config file
-#define MODEL_BMW_X1_SPEED_ID 0x1B4
-#define MODEL_BMW_X1_SPEED_BYTE 0
+// BMW X1 signals that aren't in the signal database yet
 #define MODEL_BMW_X1_RPM_ID 0x0AA
 #define MODEL_BMW_X1_RPM_BYTE 4
 #define MODEL_BMW_X1_HANDBRAKE_ID 0x1B4  // Not implemented yet
@@ -115,34 +121,47 @@ const int JOYSTICK_DEAD_ZONE = 8000;
 int gLastAccelValue = 0; // Non analog R2
 
 int s; // socket
-struct canfd_frame cf;
 char *traffic_log = DEFAULT_CAN_TRAFFIC;
 struct ifreq ifr;
-int door_pos = DEFAULT_DOOR_POS;
-int signal_pos = DEFAULT_SIGNAL_POS;
-int speed_pos = DEFAULT_SPEED_POS;
-int door_len = DEFAULT_DOOR_POS + 1;
-int signal_len = DEFAULT_DOOR_POS + 1;
-int speed_len = DEFAULT_SPEED_POS + 2;
 int difficulty = DEFAULT_DIFFICULTY;
 char *model = NULL;
+char *signal_file = NULL; // Signal database, DATA_DIR/signals.txt by default
+struct signal_db signal_db;
+struct signal_plan plans[NUM_SIGNALS]; // Where each signal goes, same layout as icsim
+int frame_len[NUM_SIGNALS]; // Classic frame length for each signal
+int fd_mode = 0; // Pack every signal into one CAN FD frame, see signal_pack_fd()
+int fd_len = 0; // Payload of the packed frame, a valid CAN FD length
 
 int lock_enabled = 0;
 int unlock_enabled = 0;
-char door_state = 0xf;
-char signal_state = 0;
-int throttle = 0;
-float current_speed = 0;
-int turning = 0;
-int door_id, signal_id, speed_id;
-int currentTime;
-int lastAccel = 0;
-int lastTurnSignal = 0;
+atomic_int door_state = 0xf; // Set by the UI or scenario, read by the scheduler in FD mode
+char signal_state = 0; // Only touched by the scheduler thread
+atomic_int throttle = 0;
+float current_speed = 0; // Only touched by the scheduler thread
+atomic_int turning = 0;
+atomic_int limiter_hit = 0; // Set by the scheduler, rumbles the controller
 
 int seed = 0;
 int debug = 0;
 
-int play_id;
+struct replay replay = { .sock = -1, .stop_fd = -1, .timer_fd = -1 };
+double replay_rate = 1; // Background traffic speed, 0 = as fast as possible
+int replay_passes = 0; // 0 = loop forever
+struct busload busload;
+int use_busload = 0;
+struct cyclic cyclic; // Sends the speed and turn signal frames
+
+// Headless scenario, see load_scenario()
+enum { STEP_THROTTLE, STEP_TURN, STEP_LOCK, STEP_UNLOCK, STEP_WAIT };
+struct scenario_step {
+	int cmd;
+	int arg; // Throttle/turn direction, door bits or milliseconds
+};
+struct scenario_step scenario[MAX_SCENARIO_STEPS];
+int scenario_len = 0;
+char *scenario_file = NULL;
+double time_scale = 1; // Virtual seconds per real second
+sigset_t stop_signals; // SIGINT and SIGTERM, blocked in every thread in scenario mode
 int kk = 0;
 char data_file[256];
 SDL_GameController *gGameController = NULL;
@@ -165,120 +184,125 @@ char *get_data(char *fname) {
 }
 
 
-void send_pkt(int mtu) {
-  if(write(s, &cf, mtu) != mtu) {
+void send_pkt(struct canfd_frame *cf, int mtu) {
+  if(write(s, cf, mtu) != mtu) {
 	perror("write");
   }
 }
 
 // Randomizes bytes in CAN packet if difficulty is hard enough
-void randomize_pkt(int start, int stop) {
+void randomize_pkt(struct canfd_frame *cf, int start, int stop) {
 	if (difficulty < 2) return;
 	int i = start;
 	for(;i < stop;i++) {
-		if(rand() % 3 < 1) cf.data[i] = rand() % 255;
+		if(rand() % 3 < 1) cf->data[i] = rand() % 255;
 	}
 }
 
-void send_lock(char door) {
-	door_state |= door;
+// Writes a signal into a frame, its bytes are cleared first so the
+// randomized padding only lands around it
+void put_signal(struct canfd_frame *cf, int sig, double value) {
+	struct signal_plan *p = &plans[sig];
+
+	memset(&cf->data[p->idx[0]], 0, p->min_len - p->idx[0]);
+	signal_encode(p, cf->data, value);
+}
+
+// Idles around a few mph like a real speedometer when stopped
+double speed_value() {
+	if (current_speed == 0) return (rand() % 300) / 100.0;
+	return current_speed;
+}
+
+// Classic mode: each signal goes out in its own frame
+void send_signal(int sig, double value) {
+	struct canfd_frame cf;
+
 	memset(&cf, 0, sizeof(cf));
-	cf.can_id = door_id;
-	cf.len = door_len;
-	cf.data[door_pos] = door_state;
-	if (door_pos) randomize_pkt(0, door_pos);
-	if (door_len != door_pos + 1) randomize_pkt(door_pos + 1, door_len);
-	send_pkt(CAN_MTU);
+	cf.can_id = plans[sig].id;
+	cf.len = frame_len[sig];
+	randomize_pkt(&cf, 0, frame_len[sig]);
+	put_signal(&cf, sig, value);
+	send_pkt(&cf, CAN_MTU);
 }
 
-void send_unlock(char door) {
-	door_state &= ~door;
+// CAN FD mode: the speed, turn signals and doors go out together
+// Bytes no signal uses are padding, randomized like the classic frames
+// Only sent from the scheduler thread, which owns the speed and signal state
+void send_fd_frame() {
+	struct canfd_frame cf;
+
 	memset(&cf, 0, sizeof(cf));
-	cf.can_id = door_id;
-	cf.len = door_len;
-	cf.data[door_pos] = door_state;
-	if (door_pos) randomize_pkt(0, door_pos);
-	if (door_len != door_pos + 1) randomize_pkt(door_pos + 1, door_len);
-	send_pkt(CAN_MTU);
+	cf.can_id = plans[SIGNAL_SPEED].id;
+	cf.len = fd_len;
+	cf.flags = CANFD_BRS;
+	randomize_pkt(&cf, 0, fd_len);
+	put_signal(&cf, SIGNAL_SPEED, speed_value());
+	put_signal(&cf, SIGNAL_TURN, signal_state);
+	put_signal(&cf, SIGNAL_DOOR, atomic_load(&door_state));
+	send_pkt(&cf, CANFD_MTU);
 }
 
-void send_speed() {
-	if (model) {
-		if (!strncmp(model, "bmw", 3)) {
-		        int b = ((16 * current_speed)/256) + 208;
-			int a = 16 * current_speed - ((b-208) * 256);
-		        memset(&cf, 0, sizeof(cf));
-		        cf.can_id = speed_id;
-		        cf.len = speed_len;
-		        cf.data[speed_pos+1] = (char)b & 0xff;
-		        cf.data[speed_pos] = (char)a & 0xff;
-		        if(current_speed == 0) { // IDLE
-		                cf.data[speed_pos] = rand() % 80;
-		                cf.data[speed_pos+1] = 208;
-		        }
-		        if (speed_pos) randomize_pkt(0, speed_pos);
-		        if (speed_len != speed_pos + 2) randomize_pkt(speed_pos+2, speed_len);
-		        send_pkt(CAN_MTU);
-		}
-	} else {
-		int kph = (current_speed / 0.6213751) * 100;
-		memset(&cf, 0, sizeof(cf));
-		cf.can_id = speed_id;
-		cf.len = speed_len;
-		cf.data[speed_pos+1] = (char)kph & 0xff;
-		cf.data[speed_pos] = (char)(kph >> 8) & 0xff;
-		if(kph == 0) { // IDLE
-			cf.data[speed_pos] = 1;
-			cf.data[speed_pos+1] = rand() % 255+100;
-		}
-		if (speed_pos) randomize_pkt(0, speed_pos);
-		if (speed_len != speed_pos + 2) randomize_pkt(speed_pos+2, speed_len);
-		send_pkt(CAN_MTU);
-	}
+void send_lock(char door) {
+	int state = atomic_fetch_or(&door_state, door) | door;
+
+	// In FD mode the scheduler sends it with the next speed frame
+	if (!fd_mode) send_signal(SIGNAL_DOOR, state);
 }
 
-void send_turn_signal() {
-	memset(&cf, 0, sizeof(cf));
-	cf.can_id = signal_id;
-	cf.len = signal_len;
-	cf.data[signal_pos] = signal_state;
-	if(signal_pos) randomize_pkt(0, signal_pos);
-	if(signal_len != signal_pos + 1) randomize_pkt(signal_pos+1, signal_len);
-	send_pkt(CAN_MTU);
+void send_unlock(char door) {
+	int state = atomic_fetch_and(&door_state, ~door) & ~door;
+
+	if (!fd_mode) send_signal(SIGNAL_DOOR, state);
 }
 
 // Checks throttle to see if we should accelerate or decelerate the vehicle
-void checkAccel() {
-	float rate = MAX_SPEED / (ACCEL_RATE * 100);
-	// Updated every 10 ms
-	if(currentTime > lastAccel + 10) {
-		if(throttle < 0) {
-			current_speed -= rate;
-			if(current_speed < 1) current_speed = 0;
-		} else if(throttle > 0) {
-			current_speed += rate;
-			if(current_speed > MAX_SPEED) { // Limiter
-				current_speed = MAX_SPEED;
-				if(gHaptic != NULL) {SDL_HapticRumblePlay( gHaptic, 0.5, 1000); printf("DEBUG HAPTIC\n"); }
-			}
+// Runs from the scheduler every SPEED_PERIOD_MS
+void checkAccel(void *arg) {
+	float rate = MAX_SPEED / (ACCEL_RATE * (1000 / SPEED_PERIOD_MS));
+	(void)arg;
+	if(throttle < 0) {
+		current_speed -= rate;
+		if(current_speed < 1) current_speed = 0;
+	} else if(throttle > 0) {
+		current_speed += rate;
+		if(current_speed > MAX_SPEED) { // Limiter
+			limiter_hit = 1;
+			current_speed = MAX_SPEED;
 		}
-		send_speed();
-		lastAccel = currentTime;
 	}
+	if (fd_mode) send_fd_frame();
+	else send_signal(SIGNAL_SPEED, speed_value());
 }
 
 // Checks if turning and activates the turn signal
-void checkTurn() {
-	if(currentTime > lastTurnSignal + 500) {
-		if(turning < 0) {
-			signal_state ^= CAN_LEFT_SIGNAL;
-		} else if(turning > 0) {
-			signal_state ^= CAN_RIGHT_SIGNAL;
-		} else {
-			signal_state = 0;
-		}
-		send_turn_signal();
-		lastTurnSignal = currentTime;
+// Runs from the scheduler every SIGNAL_PERIOD_MS
+void checkTurn(void *arg) {
+	(void)arg;
+	if(turning < 0) {
+		signal_state ^= CAN_LEFT_SIGNAL;
+	} else if(turning > 0) {
+		signal_state ^= CAN_RIGHT_SIGNAL;
+	} else {
+		signal_state = 0;
+	}
+	// The FD frame picks the new state up on its next speed period
+	if (!fd_mode) send_signal(SIGNAL_TURN, signal_state);
+}
+
+// Sends the cyclic messages from a timer thread so they keep their period
+// however busy the event loop gets
+// time_scale speeds them up along with the rest of a scenario
+void start_cyclic() {
+	cyclic_init(&cyclic);
+	if(cyclic_add(&cyclic, "speed", SPEED_PERIOD_MS * 1e6 / time_scale, checkAccel, NULL) < 0 ||
+	   cyclic_add(&cyclic, "signal", SIGNAL_PERIOD_MS * 1e6 / time_scale, checkTurn, NULL) < 0) {
+		printf("Could not schedule the cyclic messages\n");
+		exit(1);
+	}
+	if(cyclic_start(&cyclic) < 0) {
+		printf("Could not start the cyclic message scheduler\n");
+		exit(1);
 	}
 }
 
@@ -362,13 +386,168 @@ void kk_check(int k) {
 
 // Plays background can traffic
 void play_can_traffic() {
-	char can2can[50];
-	snprintf(can2can, 49, "%s=can0", ifr.ifr_name);
-	if(execlp("canplayer", "canplayer", "-I", traffic_log, "-l", "i", can2can, NULL) == -1) printf("WARNING: Could not execute canplayer. No bg data\n");
+	if(replay_load(&replay, traffic_log) < 0) {
+		printf("WARNING: Could not read %s. No bg data\n", traffic_log);
+		return;
+	}
+	replay.rate = replay_rate;
+	replay.loop = replay_passes;
+	if(replay_start(&replay, ifr.ifr_name) < 0) printf("WARNING: Could not start the traffic replay. No bg data\n");
 }
 
-void kill_child() {
-	kill(play_id, SIGINT);
+// Generates synthetic bg traffic next to the controls' own frames
+void start_busload() {
+	int i;
+
+	for(i = 0; i < NUM_SIGNALS; i++) busload_exclude(&busload, plans[i].id);
+	if(busload_start(&busload, ifr.ifr_name) < 0) printf("WARNING: Could not start the bus load generator\n");
+}
+
+// Parses a door list for lock/unlock: "all" or door numbers 1-4, Ex: 1,3
+int parse_doors(char *arg) {
+	int doors = 0, door;
+	char *tok, *save;
+
+	if(!strcmp(arg, "all")) return ALL_DOORS;
+	for(tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		door = atoi(tok);
+		if(door < 1 || door > 4) return -1;
+		doors |= 1 << (door - 1);
+	}
+	return doors ? doors : -1;
+}
+
+/*
+ * Loads a scenario, one command per line, run in order:
+ *
+ * throttle 1|0|-1       accelerate, hold the speed or slow down
+ * turn left|right|off   turn signals
+ * lock all|1,2,3,4      lock doors
+ * unlock all|1,2,3,4    unlock doors
+ * wait <ms>             let time pass
+ *
+ * Everything after a '#' is a comment.  Returns -1 on the first bad line.
+ */
+int load_scenario(char *fname) {
+	char line[256], cmd[32], arg[64];
+	struct scenario_step *step;
+	int lineno = 0, n;
+	FILE *fp;
+
+	fp = fopen(fname, "r");
+	if(!fp) {
+		perror(fname);
+		return -1;
+	}
+	while(fgets(line, sizeof(line), fp)) {
+		lineno++;
+		if(strchr(line, '#')) *strchr(line, '#') = 0;
+		n = sscanf(line, "%31s %63s", cmd, arg);
+		if(n <= 0) continue;
+		if(scenario_len == MAX_SCENARIO_STEPS) {
+			printf("%s:%d: too many steps\n", fname, lineno);
+			break;
+		}
+		step = &scenario[scenario_len];
+		step->arg = -2;
+		if(n == 2 && !strcmp(cmd, "throttle")) {
+			step->cmd = STEP_THROTTLE;
+			if(!strcmp(arg, "1") || !strcmp(arg, "0") || !strcmp(arg, "-1")) step->arg = atoi(arg);
+		} else if(n == 2 && !strcmp(cmd, "turn")) {
+			step->cmd = STEP_TURN;
+			if(!strcmp(arg, "left")) step->arg = -1;
+			else if(!strcmp(arg, "right")) step->arg = 1;
+			else if(!strcmp(arg, "off")) step->arg = 0;
+		} else if(n == 2 && (!strcmp(cmd, "lock") || !strcmp(cmd, "unlock"))) {
+			step->cmd = !strcmp(cmd, "lock") ? STEP_LOCK : STEP_UNLOCK;
+			step->arg = parse_doors(arg);
+			if(step->arg < 0) step->arg = -2;
+		} else if(n == 2 && !strcmp(cmd, "wait")) {
+			step->cmd = STEP_WAIT;
+			step->arg = atoi(arg);
+			if(step->arg < 0) step->arg = -2;
+		}
+		if(step->arg == -2) {
+			printf("%s:%d: invalid command: %s", fname, lineno, line);
+			break;
+		}
+		scenario_len++;
+	}
+	n = feof(fp);
+	fclose(fp);
+	return n && scenario_len ? 0 : -1;
+}
+
+// Sleeps ms of scenario time, returns -1 if SIGINT or SIGTERM came in
+// meanwhile.  They are blocked in all threads, so they stay pending for
+// the process until taken here whichever thread the kernel picked.
+int scenario_wait(int ms) {
+	// Scaled once and split, tv_nsec must stay under a second
+	uint64_t end = mono_ns() + (uint64_t)(ms * 1e6 / time_scale), now, left;
+	struct timespec ts;
+
+	for(;;) {
+		now = mono_ns();
+		left = end > now ? end - now : 0;
+		ts.tv_sec = left / 1000000000ULL;
+		ts.tv_nsec = left % 1000000000ULL;
+		if(sigtimedwait(&stop_signals, NULL, &ts) > 0) return -1;
+		if(errno == EAGAIN) return 0;
+		if(errno != EINTR) {
+			perror("sigtimedwait");
+			return -1;
+		}
+	}
+}
+
+// Plays the scenario through the same state the keyboard and joystick drive
+void run_scenario() {
+	struct timespec start, end;
+	double virt = 0;
+	int i, stopped = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < scenario_len && !stopped; i++) {
+		switch(scenario[i].cmd) {
+		case STEP_THROTTLE:
+			throttle = scenario[i].arg;
+			break;
+		case STEP_TURN:
+			turning = scenario[i].arg;
+			break;
+		case STEP_LOCK:
+			send_lock(scenario[i].arg);
+			break;
+		case STEP_UNLOCK:
+			send_unlock(scenario[i].arg);
+			break;
+		case STEP_WAIT:
+			// A signal cuts the wait short and ends the scenario
+			if(scenario_wait(scenario[i].arg) < 0) stopped = 1;
+			virt += scenario[i].arg / 1000.0;
+			break;
+		}
+		if(debug) printf("Scenario step %d at %.3fs\n", i + 1, virt);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("Scenario: %d of %d steps, %.3fs virtual in %.3fs\n", i, scenario_len, virt,
+	       (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+// Stops the background senders and prints what they did
+void stop_traffic() {
+  cyclic_stop(&cyclic);
+  cyclic_print_stats(&cyclic);
+  if(replay.stop_fd >= 0) {
+	replay_stop(&replay);
+	replay_print_stats(&replay);
+  }
+  replay_free(&replay);
+  if(busload.stop_fd >= 0) {
+	busload_stop(&busload);
+	busload_print_stats(&busload);
+  }
+  close(s);
 }
 
 void redraw_screen() {
@@ -438,23 +617,36 @@ void usage(char *msg) {
   printf("Usage: controls [options] <can>\n");
   printf("\t-s\tseed value from IC\n");
   printf("\t-l\tdifficulty level. 0-2 (default: %d)\n", DEFAULT_DIFFICULTY);
-  printf("\t-t\ttraffic file to use for bg CAN traffic\n");
+  printf("\t-t\ttraffic file to use for bg CAN traffic, candump log or capture\n");
   printf("\t-m\tModel (Ex: -m bmw)\n");
+  printf("\t-D\tsignal database FILE, the same one icsim uses (default: %ssignals.txt)\n", DATA_DIR);
+  printf("\t-f\tCAN FD mode, speed, signal and door packed in one frame (run icsim with -f)\n");
+  printf("\t-R\tbg traffic speed multiplier, 0 = as fast as possible (default: 1)\n");
+  printf("\t-n\tnumber of times to play the bg traffic, 0 = forever (default: 0)\n");
+  printf("\t-L\tgenerate random bg traffic filling this %% of the bus\n");
+  printf("\t-F\tgenerate random bg traffic at this many frames/s\n");
+  printf("\t-b\tnominal bitrate for -L (default: %d)\n", BL_DEFAULT_BITRATE);
+  printf("\t-I\tIDs to generate, Ex: 0x100-0x1ff,0x300 (default: 0x001-0x7ff)\n");
+  printf("\t-N\tlengths to generate, Ex: 0-8 or 2,8,8 (default: 8)\n");
+  printf("\t-S\trun the scenario in this file without a window or controller\n");
+  printf("\t-A\tscenario time speed up (default: 1 = real time)\n");
   printf("\t-X\tDisable background CAN traffic.  Cheating if doing RE but needed if playing on a real CANbus\n");
   printf("\t-d\tdebug mode\n");
   exit(1);
 }
 
 int main(int argc, char *argv[]) {
-  int opt;
+  int opt, i;
   struct sockaddr_can addr;
+  struct signal_def defs[NUM_SIGNALS];
   int running = 1;
   int enable_canfd = 1;
   int play_traffic = 1;
   struct stat st;
   SDL_Event event;
 
-  while ((opt = getopt(argc, argv, "Xdl:s:t:m:h?")) != -1) {
+  busload_init(&busload);
+  while ((opt = getopt(argc, argv, "Xdfl:s:t:m:D:R:n:L:F:b:I:N:S:A:h?")) != -1) {
     switch(opt) {
 	case 'l':
 		difficulty = atoi(optarg);
@@ -471,6 +663,48 @@ int main(int argc, char *argv[]) {
 	case 'm':
 		model = optarg;
 		break;
+	case 'D':
+		signal_file = optarg;
+		break;
+	case 'f':
+		fd_mode = 1;
+		break;
+	case 'R':
+		replay_rate = atof(optarg);
+		if(replay_rate < 0) usage("The speed multiplier can't be negative");
+		break;
+	case 'n':
+		replay_passes = atoi(optarg);
+		break;
+	case 'L':
+		busload.load = atof(optarg) / 100;
+		if(busload.load <= 0 || busload.load > 1) usage("The bus load must be between 0 and 100%");
+		use_busload = 1;
+		break;
+	case 'F':
+		busload.fps = atof(optarg);
+		if(busload.fps <= 0) usage("The frame rate must be positive");
+		use_busload = 1;
+		break;
+	case 'b':
+		busload.bitrate = strtoul(optarg, NULL, 0);
+		if(!busload.bitrate) usage("Invalid bitrate");
+		break;
+	case 'I':
+		if(busload_parse_dist(&busload.ids, optarg, CAN_EFF_MASK) < 0) usage("Invalid ID list");
+		break;
+	case 'N':
+		if(busload_parse_dist(&busload.lens, optarg, CAN_MAX_DLEN) < 0) usage("Invalid length list");
+		break;
+	case 'S':
+		scenario_file = optarg;
+		break;
+	case 'A':
+		time_scale = atof(optarg);
+		if(time_scale <= 0) usage("The speed up must be positive");
+		// The scaled periods are whole nanoseconds, keep them sensible
+		if(SPEED_PERIOD_MS * 1e6 / time_scale < MIN_PERIOD_NS) usage("The speed up makes the speed period shorter than 1 us");
+		break;
 	case 'X':
 		play_traffic = 0;
 		break;
@@ -483,6 +717,15 @@ int main(int argc, char *argv[]) {
   }
 
   if (optind >= argc) usage("You must specify at least one can device");
+  if (busload.load > 0 && busload.fps > 0) usage("-L and -F can't be used together");
+  if (scenario_file && load_scenario(scenario_file) < 0) usage("Could not load the scenario");
+  if (!signal_file) signal_file = get_data("signals.txt");
+  if (signal_db_load(&signal_db, signal_file) < 0) exit(1);
+  if (model && !signal_db_has_model(&signal_db, model)) {
+	printf("Invalid model.  ");
+	signal_db_print_models(&signal_db);
+	exit(1);
+  }
 
   if(stat(traffic_log, &st) == -1) {
 	char msg[256];
@@ -516,60 +759,46 @@ int main(int argc, char *argv[]) {
        return 1;
   }
 
-  door_id = DEFAULT_DOOR_ID;
-  signal_id = DEFAULT_SIGNAL_ID;
-  speed_id = DEFAULT_SPEED_ID;
-
-  if (seed) {
-	srand(seed);
-        door_id = (rand() % 2046) + 1;
-        signal_id = (rand() % 2046) + 1;
-        speed_id = (rand() % 2046) + 1;
-        door_pos = rand() % 9;
-        signal_pos = rand() % 9;
-        speed_pos = rand() % 8;
-        printf("Seed: %d\n", seed);
-	door_len = door_pos + 1;
-	signal_len = signal_pos + 1;
-	speed_len = speed_len + 2;
-  } else if (model) {
-	if (!strncmp(model, "bmw", 3)) {
-		speed_id = MODEL_BMW_X1_SPEED_ID;
-		speed_pos = MODEL_BMW_X1_SPEED_BYTE;
-	} else {
-		printf("Invalid model.  Valid entries are: bmw\n");
-	}
+  // Same layout as icsim given the same seed, model and -f
+  if (signal_layout(&signal_db, model, seed, fd_mode, defs) < 0) exit(1);
+  if (seed) printf("Seed: %d\n", seed);
+  for(i = 0; i < NUM_SIGNALS; i++) {
+	signal_compile(&defs[i], &plans[i]);
+	frame_len[i] = plans[i].min_len;
+	if (plans[i].min_len > fd_len) fd_len = plans[i].min_len;
   }
+  signal_db_free(&signal_db);
 
-  if(difficulty > 0) {
-	if (door_len < 8) {
-		door_len += rand() % (8 - door_len);
-	} else {
-		door_len = 0;
-	}
-	if (signal_len < 8) {
-		signal_len += rand() % (8 - signal_len);
-	} else {
-		signal_len = 0;
-	}
-	if (speed_len < 8) {
-		speed_len += rand() % (8 - speed_len);
-	} else {
-		speed_len = 0;
+  if (fd_mode) {
+	if (difficulty > 0 && fd_len < CANFD_MAX_DLEN) fd_len += rand() % (CANFD_MAX_DLEN - fd_len);
+	// Round up to the next length a CAN FD DLC can express
+	fd_len = can_dlc2len(can_len2dlc(fd_len));
+  } else if(difficulty > 0) {
+	for(i = 0; i < NUM_SIGNALS; i++) {
+		if (frame_len[i] < 8) {
+			frame_len[i] += rand() % (8 - frame_len[i]);
+		} else {
+			frame_len[i] = 0;
+		}
 	}
   }
 
-  if(play_traffic) {
-	play_id = fork();
-	if((int)play_id == -1) {
-		printf("Error: Couldn't fork bg player\n");
-		exit(-1);
-	} else if (play_id == 0) {
-		play_can_traffic();
-		// Shouldn't return
-		exit(0);
-	}
-	atexit(kill_child);
+  if(scenario_file) {
+	// Before any thread starts so they all inherit the mask
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+  }
+  if(play_traffic) play_can_traffic();
+  if(use_busload) start_busload();
+
+  if(scenario_file) {
+	// Headless, SDL is never initialized
+	start_cyclic();
+	run_scenario();
+	stop_traffic();
+	return 0;
   }
 
   // GUI Setup
@@ -612,6 +841,8 @@ int main(int argc, char *argv[]) {
   SDL_RenderPresent(renderer);
   int button, axis; // Used for checking dynamic joystick mappings
 
+  start_cyclic();
+
   while(running) {
     while( SDL_PollEvent(&event) != 0 ) {
         switch(event.type) {
@@ -797,13 +1028,15 @@ int main(int argc, char *argv[]) {
 		break;
         }
     }
-    currentTime = SDL_GetTicks();
-    checkAccel();
-    checkTurn();
+    if(limiter_hit && gHaptic != NULL) {
+	limiter_hit = 0;
+	SDL_HapticRumblePlay( gHaptic, 0.5, 1000);
+	printf("DEBUG HAPTIC\n");
+    }
     SDL_Delay(5);
   }
 
-  close(s);
+  stop_traffic();
   SDL_DestroyTexture(base_texture);
   SDL_FreeSurface(image);
   SDL_GameControllerClose(gGameController);
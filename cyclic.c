@@ -0,0 +1,133 @@
+/*
+ * Cyclic message scheduler
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
+
+#include "cyclic.h"
+#include "timeutil.h"
+
+void cyclic_init(struct cyclic *cy) {
+  memset(cy, 0, sizeof(*cy));
+  cy->timer_fd = cy->stop_fd = -1;
+}
+
+int cyclic_add(struct cyclic *cy, char *name, uint64_t period_ns, cyclic_fn fn, void *arg) {
+  struct cyclic_task *t;
+
+  if(cy->ntasks == CYCLIC_MAX_TASKS || !period_ns) return -1;
+  t = &cy->tasks[cy->ntasks++];
+  memset(t, 0, sizeof(*t));
+  t->name = name;
+  t->period_ns = period_ns;
+  t->fn = fn;
+  t->arg = arg;
+  hist_init(&t->jitter);
+  hist_init(&t->late);
+  return 0;
+}
+
+static void run_task(struct cyclic_task *t, uint64_t now) {
+  uint64_t behind, interval;
+
+  hist_record(&t->late, now - t->next_ns);
+  if(t->last_ns) {
+    interval = now - t->last_ns;
+    hist_record(&t->jitter, interval > t->period_ns ? interval - t->period_ns : t->period_ns - interval);
+  } else {
+    t->first_ns = now;
+  }
+  t->last_ns = now;
+  t->fn(t->arg);
+  t->runs++;
+  t->next_ns += t->period_ns;
+  // Too far behind to catch up, move on to the next deadline on the grid
+  if(now > t->next_ns + CYCLIC_MAX_BEHIND * t->period_ns) {
+    behind = (now - t->next_ns) / t->period_ns + 1;
+    t->skipped += behind;
+    t->next_ns += behind * t->period_ns;
+  }
+}
+
+static void *cyclic_thread(void *arg) {
+  struct cyclic *cy = arg;
+  uint64_t now, next;
+  int i;
+
+  // Default timer slack is 50us, well above what we are after
+  prctl(PR_SET_TIMERSLACK, 1UL);
+  while(!atomic_load_explicit(&cy->stop, memory_order_relaxed)) {
+    next = cy->tasks[0].next_ns;
+    for(i = 1; i < cy->ntasks; i++)
+      if(cy->tasks[i].next_ns < next) next = cy->tasks[i].next_ns;
+    if(next > mono_ns() && wait_until(cy->timer_fd, cy->stop_fd, next) < 0) break;
+    now = mono_ns();
+    // Each due task runs once per pass, so a late one can't starve the others
+    for(i = 0; i < cy->ntasks; i++)
+      if(cy->tasks[i].next_ns <= now)
+        run_task(&cy->tasks[i], now);
+  }
+  return NULL;
+}
+
+int cyclic_start(struct cyclic *cy) {
+  uint64_t now = mono_ns();
+  int i;
+
+  if(!cy->ntasks) return -1;
+  for(i = 0; i < cy->ntasks; i++)
+    cy->tasks[i].next_ns = now + cy->tasks[i].period_ns;
+  cy->stop_fd = eventfd(0, EFD_CLOEXEC);
+  cy->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if(cy->stop_fd < 0 || cy->timer_fd < 0) {
+    perror("cyclic eventfd/timerfd");
+    goto error;
+  }
+  atomic_store(&cy->stop, 0);
+  if(pthread_create(&cy->tid, NULL, cyclic_thread, cy) != 0) {
+    printf("Could not start the cyclic scheduler thread\n");
+    goto error;
+  }
+  return 0;
+
+error:
+  if(cy->stop_fd >= 0) close(cy->stop_fd);
+  if(cy->timer_fd >= 0) close(cy->timer_fd);
+  cy->stop_fd = cy->timer_fd = -1;
+  return -1;
+}
+
+void cyclic_stop(struct cyclic *cy) {
+  uint64_t one = 1;
+
+  if(cy->stop_fd < 0) return;
+  atomic_store(&cy->stop, 1);
+  if(write(cy->stop_fd, &one, sizeof(one)) != sizeof(one)) perror("cyclic stop");
+  pthread_join(cy->tid, NULL);
+  close(cy->stop_fd);
+  close(cy->timer_fd);
+  cy->stop_fd = cy->timer_fd = -1;
+}
+
+void cyclic_print_stats(struct cyclic *cy) {
+  struct cyclic_task *t;
+  int i;
+
+  for(i = 0; i < cy->ntasks; i++) {
+    t = &cy->tasks[i];
+    printf("Cyclic %s: %lu runs every %.3f ms, %lu skipped\n", t->name, t->runs, t->period_ns / 1e6, t->skipped);
+    if(t->runs < 2) continue;
+    printf("  mean period %.3f ms, jitter (us): p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+           (t->last_ns - t->first_ns) / 1e6 / (t->runs - 1),
+           hist_percentile(&t->jitter, 50) / 1e3, hist_percentile(&t->jitter, 99) / 1e3,
+           hist_percentile(&t->jitter, 99.9) / 1e3, atomic_load(&t->jitter.max) / 1e3);
+    printf("  late (us): p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+           hist_percentile(&t->late, 50) / 1e3, hist_percentile(&t->late, 99) / 1e3,
+           hist_percentile(&t->late, 99.9) / 1e3, atomic_load(&t->late.max) / 1e3);
+  }
+}
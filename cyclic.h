@@ -0,0 +1,72 @@
+/*
+ * Cyclic message scheduler
+ *
+ * Runs periodic tasks, such as sending the speed frame every 10 ms, from a
+ * background thread woken by a timerfd at the exact deadline of the next
+ * task.  Deadlines stay on a fixed grid: a task that runs late is run
+ * again as soon as it can until it has caught up instead of its period
+ * stretching.  How far the time between runs strays from the period and
+ * how late each run was are kept per task.
+ */
+
+#ifndef ICSIM_CYCLIC_H
+#define ICSIM_CYCLIC_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "histogram.h"
+
+#define CYCLIC_MAX_TASKS 16
+#define CYCLIC_MAX_BEHIND 10 // Periods a task may fall behind before runs are skipped
+
+typedef void (*cyclic_fn)(void *arg);
+
+struct cyclic_task {
+  char *name;
+  uint64_t period_ns;
+  cyclic_fn fn;
+  void *arg;
+  uint64_t next_ns; // Deadline of the next run
+  uint64_t first_ns; // Start of the first run
+  uint64_t last_ns; // Start of the previous run
+  // Statistics
+  unsigned long runs;
+  unsigned long skipped; // Runs given up on after falling too far behind
+  struct histogram jitter; // |time between two runs - period|
+  struct histogram late; // Run start - deadline
+};
+
+struct cyclic {
+  struct cyclic_task tasks[CYCLIC_MAX_TASKS];
+  int ntasks;
+  int timer_fd;
+  int stop_fd; // eventfd, wakes the thread up to stop
+  atomic_int stop;
+  pthread_t tid;
+};
+
+void cyclic_init(struct cyclic *cy);
+
+int cyclic_add(struct cyclic *cy, char *name, uint64_t period_ns, cyclic_fn fn, void *arg);
+/*
+ * Adds a task run every period_ns, tasks must be added before starting.
+ * Returns 0 on success, -1 if there are too many tasks.
+ */
+
+int cyclic_start(struct cyclic *cy);
+/*
+ * Starts the scheduler thread, all tasks first run one period from now.
+ * Returns 0 on success, -1 on error.
+ */
+
+void cyclic_stop(struct cyclic *cy);
+/*
+ * Stops the scheduler thread and waits for it, safe to call if it was
+ * never started.
+ */
+
+void cyclic_print_stats(struct cyclic *cy);
+
+#endif
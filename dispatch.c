@@ -0,0 +1,119 @@
+/*
+ * CAN ID dispatch table
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dispatch.h"
+
+#define EFF_INITIAL_SIZE 16
+
+/* Returns the EFF slot for id, either the one holding it or the empty one
+ * it would go in
+ */
+static struct dispatch_eff_slot *eff_slot(struct can_dispatch *d, canid_t id) {
+  unsigned int i = dispatch_eff_hash(id, d->eff_size);
+
+  while(d->eff[i].id && d->eff[i].id != id)
+    i = (i + 1) & (d->eff_size - 1);
+  return &d->eff[i];
+}
+
+static int eff_grow(struct can_dispatch *d) {
+  struct dispatch_eff_slot *old = d->eff;
+  unsigned int i, old_size = d->eff_size;
+
+  d->eff_size = old_size ? old_size * 2 : EFF_INITIAL_SIZE;
+  d->eff = calloc(d->eff_size, sizeof(*d->eff));
+  if(!d->eff) {
+    d->eff = old;
+    d->eff_size = old_size;
+    return -1;
+  }
+  for(i = 0; i < old_size; i++)
+    if(old[i].id) *eff_slot(d, old[i].id) = old[i];
+  free(old);
+  return 0;
+}
+
+void dispatch_init(struct can_dispatch *d) {
+  memset(d, 0, sizeof(*d));
+}
+
+static void free_handlers(struct dispatch_handler *h) {
+  struct dispatch_handler *next;
+
+  for(; h; h = next) {
+    next = h->next;
+    free(h);
+  }
+}
+
+void dispatch_free(struct can_dispatch *d) {
+  unsigned int i;
+
+  for(i = 0; i <= CAN_SFF_MASK; i++) free_handlers(d->sff[i]);
+  for(i = 0; i < d->eff_size; i++) free_handlers(d->eff[i].handlers);
+  free(d->eff);
+  dispatch_init(d);
+}
+
+int dispatch_add(struct can_dispatch *d, canid_t id, dispatch_fn fn, void *arg) {
+  struct dispatch_handler *h, **tail;
+  struct dispatch_eff_slot *slot;
+
+  h = malloc(sizeof(*h));
+  if(!h) return -1;
+  h->fn = fn;
+  h->arg = arg;
+  h->next = NULL;
+
+  if(id & CAN_EFF_FLAG) {
+    id &= CAN_EFF_MASK | CAN_EFF_FLAG;
+    // Keep the load factor under 1/2 so probes stay short
+    if((d->eff_count + 1) * 2 > d->eff_size && eff_grow(d) < 0) {
+      free(h);
+      return -1;
+    }
+    slot = eff_slot(d, id);
+    if(!slot->id) {
+      slot->id = id;
+      d->eff_count++;
+    }
+    tail = &slot->handlers;
+  } else {
+    tail = &d->sff[id & CAN_SFF_MASK];
+  }
+  if(!*tail) d->nids++;
+  while(*tail) tail = &(*tail)->next;
+  *tail = h;
+  return 0;
+}
+
+void dispatch_frame(struct can_dispatch *d, struct canfd_frame *cf, int maxdlen) {
+  struct dispatch_handler *h;
+  struct dispatch_eff_slot *slot;
+  canid_t id = cf->can_id;
+
+  if(id & (CAN_RTR_FLAG | CAN_ERR_FLAG)) return;
+  if(id & CAN_EFF_FLAG) {
+    if(!d->eff_count) return;
+    slot = eff_slot(d, id);
+    h = slot->handlers;
+  } else {
+    h = d->sff[id & CAN_SFF_MASK];
+  }
+  for(; h; h = h->next) h->fn(h->arg, cf, maxdlen);
+}
+
+int dispatch_ids(struct can_dispatch *d, canid_t *ids, int max) {
+  unsigned int i;
+  int count = 0;
+
+  for(i = 0; i <= CAN_SFF_MASK && count < max; i++)
+    if(d->sff[i]) ids[count++] = i;
+  for(i = 0; i < d->eff_size && count < max; i++)
+    if(d->eff[i].id) ids[count++] = d->eff[i].id;
+  return count;
+}
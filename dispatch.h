@@ -0,0 +1,68 @@
+/*
+ * CAN ID dispatch table
+ *
+ * Maps received CAN IDs to the decoders registered for them in constant
+ * time.  11-bit IDs index a direct table, 29-bit CAN_EFF_FLAG IDs live in
+ * an open addressed hash.  An ID may have several handlers, they are
+ * called in the order they were added.
+ */
+
+#ifndef ICSIM_DISPATCH_H
+#define ICSIM_DISPATCH_H
+
+#include <linux/can.h>
+
+typedef void (*dispatch_fn)(void *arg, struct canfd_frame *cf, int maxdlen);
+
+struct dispatch_handler {
+  dispatch_fn fn;
+  void *arg;
+  struct dispatch_handler *next;
+};
+
+struct dispatch_eff_slot {
+  canid_t id; // 0 = empty, EFF IDs always carry CAN_EFF_FLAG
+  struct dispatch_handler *handlers;
+};
+
+struct can_dispatch {
+  struct dispatch_handler *sff[CAN_SFF_MASK + 1];
+  struct dispatch_eff_slot *eff;
+  unsigned int eff_size; // Power of two
+  unsigned int eff_count;
+  unsigned int nids; // Distinct IDs registered
+};
+
+void dispatch_init(struct can_dispatch *d);
+void dispatch_free(struct can_dispatch *d);
+
+int dispatch_add(struct can_dispatch *d, canid_t id, dispatch_fn fn, void *arg);
+/*
+ * Registers fn to be called with arg for every frame with the given ID.
+ * IDs with CAN_EFF_FLAG set are extended, anything else is masked to 11 bits.
+ *
+ * Return values:
+ * 0 = success
+ * -1 = out of memory
+ */
+
+void dispatch_frame(struct can_dispatch *d, struct canfd_frame *cf, int maxdlen);
+/*
+ * Calls every handler registered for cf->can_id.
+ * RTR and error frames are never dispatched.
+ */
+
+int dispatch_ids(struct can_dispatch *d, canid_t *ids, int max);
+/*
+ * Fills ids with up to max registered IDs, extended ones with CAN_EFF_FLAG.
+ * Returns the number of IDs written.  Use d->nids to size the array.
+ */
+
+/* Slot of a 29-bit ID in a hash of size slots, a power of two
+ * Fibonacci hashing, the sniffer's ID table uses it as well
+ */
+static inline unsigned int dispatch_eff_hash(canid_t id, unsigned int size) {
+  return ((id & CAN_EFF_MASK) * 2654435761U) & (size - 1);
+}
+
+#endif
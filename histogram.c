@@ -0,0 +1,59 @@
+/*
+ * Lock free log bucketed histogram
+ */
+
+#include "histogram.h"
+
+#define SUB_COUNT (1 << HIST_SUB_BITS)
+
+static unsigned int bucket_of(uint64_t v) {
+  unsigned int msb;
+
+  if(v < SUB_COUNT) return v;
+  msb = 63 - __builtin_clzll(v);
+  return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((v >> (msb - HIST_SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+/* Largest value that still falls in bucket b */
+static uint64_t bucket_max(unsigned int b) {
+  unsigned int exp = b >> HIST_SUB_BITS;
+  uint64_t sub = b & (SUB_COUNT - 1);
+
+  if(exp == 0) return sub;
+  return (((uint64_t)SUB_COUNT + sub + 1) << (exp - 1)) - 1;
+}
+
+void hist_init(struct histogram *h) {
+  int i;
+
+  for(i = 0; i < HIST_BUCKETS; i++) atomic_init(&h->count[i], 0);
+  atomic_init(&h->samples, 0);
+  atomic_init(&h->max, 0);
+}
+
+void hist_record(struct histogram *h, uint64_t value) {
+  unsigned long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+
+  atomic_fetch_add_explicit(&h->count[bucket_of(value)], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->samples, 1, memory_order_relaxed);
+  while(value > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, value,
+                                                              memory_order_relaxed, memory_order_relaxed));
+}
+
+uint64_t hist_percentile(struct histogram *h, double p) {
+  unsigned long samples = atomic_load_explicit(&h->samples, memory_order_relaxed);
+  unsigned long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+  unsigned long rank, seen = 0;
+  unsigned int b;
+
+  if(!samples) return 0;
+  rank = (unsigned long)(samples * p / 100.0);
+  if(rank < samples * p / 100.0 || rank < 1) rank++; // Round up
+  if(rank > samples) rank = samples;
+  for(b = 0; b < HIST_BUCKETS; b++) {
+    seen += atomic_load_explicit(&h->count[b], memory_order_relaxed);
+    if(seen >= rank) break;
+  }
+  if(b == HIST_BUCKETS || bucket_max(b) > max) return max;
+  return bucket_max(b);
+}
@@ -0,0 +1,37 @@
+/*
+ * Lock free log bucketed histogram
+ *
+ * Values are counted in buckets that split every power of two into
+ * 2^HIST_SUB_BITS linear steps, so a percentile is accurate to within
+ * 1/2^HIST_SUB_BITS of its value whatever the range.  Any thread may
+ * record at any time, readers get a consistent enough snapshot for
+ * reporting.
+ */
+
+#ifndef ICSIM_HISTOGRAM_H
+#define ICSIM_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+struct histogram {
+  atomic_ulong count[HIST_BUCKETS];
+  atomic_ulong samples;
+  atomic_ulong max;
+};
+
+void hist_init(struct histogram *h);
+
+void hist_record(struct histogram *h, uint64_t value);
+
+uint64_t hist_percentile(struct histogram *h, double p);
+/*
+ * Returns the upper bound of the bucket holding the p'th percentile
+ * (0 < p <= 100), the recorded maximum if that is smaller, or 0 when
+ * nothing was recorded.
+ */
+
+#endif
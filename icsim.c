@@ -4,12 +4,21 @@
  * (c) 2014 Open Garages - Craig Smith <craig@theialabs.com>
  */
 
+#define _GNU_SOURCE // recvmmsg()
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
@@ -18,8 +27,14 @@
 #include <linux/can/raw.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
+#include <SDL2/SDL_syswm.h>
 
 #include "lib.h"
+#include "dispatch.h"
+#include "signals.h"
+#include "histogram.h"
+#include "capture.h"
+#include "timeutil.h"
 
 #ifndef DATA_DIR
 #define DATA_DIR "./data/"  // Needs trailing slash
@@ -31,46 +46,181 @@
 #define DOOR_UNLOCKED 1
 #define OFF 0
 #define ON 1
-#define DEFAULT_DOOR_ID 411 // 0x19b
-#define DEFAULT_DOOR_BYTE 2
 #define CAN_DOOR1_LOCK 1
-#define CAN_DOOR2_LOCK 2 
+#define CAN_DOOR2_LOCK 2
 #define CAN_DOOR3_LOCK 4
 #define CAN_DOOR4_LOCK 8
-#define DEFAULT_SIGNAL_ID 392 // 0x188
-#define DEFAULT_SIGNAL_BYTE 0
 #define CAN_LEFT_SIGNAL 1
 #define CAN_RIGHT_SIGNAL 2
-#define DEFAULT_SPEED_ID 580 // 0x244
-#define DEFAULT_SPEED_BYTE 3 // bytes 3,4
-
-// For now, specific models will be done as constants.  Later
-// We should use a config file
-#define MODEL_BMW_X1_SPEED_ID 0x1B4
-#define MODEL_BMW_X1_SPEED_BYTE 0
-#define MODEL_BMW_X1_RPM_ID 0x0AA
-#define MODEL_BMW_X1_RPM_BYTE 4
-#define MODEL_BMW_X1_HANDBRAKE_ID 0x1B4  // Not implemented yet
-#define MODEL_BMW_X1_HANDBRAKE_BYTE 5
+#define RX_BATCH 64 // Max frames pulled per recvmmsg() call
+#define WIDGET_SPEEDO 0
+#define WIDGET_SIGNALS 1
+#define WIDGET_DOORS 2
+#define NUM_WIDGETS 3
+#define ALL_DOORS_LOCKED (CAN_DOOR1_LOCK | CAN_DOOR2_LOCK | CAN_DOOR3_LOCK | CAN_DOOR4_LOCK)
+#define DEFAULT_REFRESH 60 // Hz, if the display doesn't tell us
+#define SDL_POLL_MS 10 // Input polling when SDL has no fd to wait on
+#define MAX_CLUSTERS 256
+#define MAX_BUSES 4 // CAN interfaces per cluster
+#define MAX_WORKERS 64
+#define LAT_RING 256 // Widget changes waiting for a present, per cluster
+
+struct cluster;
+
+/* A piece of the cluster that is only repainted when its decoded state
+ * changes
+ */
+struct widget {
+  char *name;
+  SDL_Rect damage; // Canvas area the widget repaints
+  void (*draw)(struct cluster *c, int state);
+};
+
+/* Per cluster state of a widget
+ * state is written by a receive worker, the rest belongs to the renderer
+ * except unchanged which belongs to the worker
+ */
+struct widget_state {
+  atomic_int state; // Latest decoded state
+  int drawn; // State currently on the canvas
+  unsigned long unchanged; // Decoded frames that left the state as is
+  unsigned long stale; // Redraws dropped because the state changed back
+  unsigned long redraws; // Repaints performed
+};
+
+/* A decoded signal, the handler argument registered for its CAN ID */
+struct cluster_signal {
+  struct cluster *c;
+  struct signal_plan plan;
+};
+
+/* Timestamps of a frame that changed a widget */
+struct lat_sample {
+  uint64_t kernel_ns;
+  uint64_t decode_ns;
+};
+
+/* A CAN interface a cluster listens on and the decoders of the signals
+ * carried on it.  Each bus has its own socket so the kernel filters and
+ * counts drops per bus.  The counters belong to the cluster's RX worker.
+ */
+struct can_bus {
+  struct cluster *c;
+  char ifname[IFNAMSIZ];
+  int signals; // Bitmask of the signals decoded from this bus
+  int can; // socket
+  struct can_dispatch dispatch; // Decoders by CAN ID
+  unsigned long rx_wakeups;
+  __u32 rx_dropcnt; // Last SO_RXQ_OVFL count seen
+  atomic_ulong rx_frames;
+  atomic_ulong rx_drops; // Frames the kernel dropped because we fell behind
+  unsigned long live_frames, live_drops; // At the last live report (-T)
+  unsigned long bus_start;
+};
+
+/* One virtual instrument cluster: its buses, layout, vehicle state and
+ * render target.  Textures decoded from DATA_DIR are shared.
+ */
+struct cluster {
+  char ifname[IFNAMSIZ]; // Name of the cluster, its first bus
+  int randomize;
+  int seed;
+  char *model;
+  int fd; // CAN FD layout, every signal in the speed frame
+  struct can_bus buses[MAX_BUSES];
+  int nbuses;
+  struct cluster_signal signals[NUM_SIGNALS]; // Layout from the signal database
+  // Vehicle state mailbox: written by the RX worker, latest value wins
+  atomic_long current_speed;
+  struct widget_state widgets[NUM_WIDGETS];
+  atomic_int dirty; // Bitmask of widgets changed since the last present
+  // What is currently drawn on the canvas, owned by the render thread
+  int door_status[4];
+  int turn_status[2];
+  SDL_Window *window;
+  SDL_Renderer *renderer;
+  SDL_Texture *base_texture;
+  SDL_Texture *needle_tex;
+  SDL_Texture *sprite_tex;
+  SDL_Texture *canvas; // Retained copy of the IC the widgets draw into
+  unsigned long presents;
+  unsigned long damaged_px;
+  unsigned long snapshots;
+  // Latency measurement (-L)
+  uint64_t rx_kernel_ns, rx_decode_ns; // Frame being decoded, owned by the RX worker
+  struct lat_sample lat_ring[LAT_RING]; // Single producer/consumer, worker to renderer
+  atomic_uint lat_head; // Written by the RX worker
+  atomic_uint lat_tail; // Written by the renderer
+  atomic_ulong lat_overruns; // Samples dropped because the ring was full
+  struct histogram lat_decode; // Kernel receive -> decode
+  struct histogram lat_present; // Decode -> present
+  struct histogram lat_total; // Kernel receive -> present
+};
+
+/* Receive worker, drains the sockets of a subset of the clusters
+ * All the buses of a cluster go to the same worker, it is the only writer
+ * of the cluster's vehicle state and latency ring
+ */
+struct rx_worker {
+  pthread_t tid;
+  int epfd;
+  int nclusters;
+};
 
 const int canfd_on = 1;
 int debug = 0;
-int randomize = 0;
-int seed = 0;
-int door_pos = DEFAULT_DOOR_BYTE;
-int signal_pos = DEFAULT_SIGNAL_BYTE;
-int speed_pos = DEFAULT_SPEED_BYTE;
-long current_speed = 0;
-int door_status[4];
-int turn_status[2];
-char *model = NULL;
 char data_file[256];
-SDL_Renderer *renderer = NULL;
-SDL_Texture *base_texture = NULL;
-SDL_Texture *needle_tex = NULL;
-SDL_Texture *sprite_tex = NULL;
+struct cluster clusters[MAX_CLUSTERS];
+int nclusters = 0;
+struct rx_worker workers[MAX_WORKERS];
+int nworkers = 0;
+int rx_stop_fd = -1; // eventfd used to stop the RX workers
+int render_fd = -1; // eventfd the RX workers use to wake the renderer
+char *signal_file = NULL; // Signal database, DATA_DIR/signals.txt by default
+struct signal_db signal_db;
+int use_filter = 1; // Let the kernel drop frames we don't decode
+int show_stats = 0;
+int measure_latency = 0;
+int stats_ms = 0; // Live receive counter period, 0 = off
+int drop_exit = 0; // Exit with status 2 if the kernel dropped frames
+int headless = 0; // Render into a software surface, no window
+char *snapshot_path = NULL;
+int snapshot_ms = 0; // Snapshot period, 0 = only on exit
+char *offline_file = NULL; // Capture decoded by -O instead of a CAN bus
+int timeline = 1; // Print the vehicle state timeline in offline mode
+// Decoded once and shared by every cluster
+SDL_Surface *ic_image = NULL;
+SDL_Surface *needle_image = NULL;
+SDL_Surface *sprite_image = NULL;
+// Headless clusters also share one software renderer and its textures
+SDL_Surface *screen = NULL;
+SDL_Renderer *shared_renderer = NULL;
 SDL_Rect speed_rect;
 
+void draw_speedo(struct cluster *c, int angle);
+void draw_signals(struct cluster *c, int state);
+void draw_doors(struct cluster *c, int state);
+
+const struct widget widgets[NUM_WIDGETS] = {
+  // Union of the three dial rects update_speed() re-blits
+  [WIDGET_SPEEDO] = { "speedo", { 200, 30, 300, 193 }, draw_speedo },
+  [WIDGET_SIGNALS] = { "signals", { 191, 29, 314, 45 }, draw_signals },
+  [WIDGET_DOORS] = { "doors", { 390, 215, 110, 85 }, draw_doors },
+};
+
+/* Decoded vehicle state, for the offline timeline */
+struct vehicle_state {
+  long speed;
+  int signals;
+  int doors;
+};
+
+/* Control message metadata kept for every received frame */
+struct rx_meta {
+  struct timespec ts;
+  __u32 dropcnt;
+};
+
 // Simple map function
 long map(long x, long in_min, long in_max, long out_min, long out_max)
 {
@@ -88,22 +238,33 @@ char *get_data(char *fname) {
 }
 
 /* Default vehicle state */
-void init_car_state() {
-  door_status[0] = DOOR_LOCKED;
-  door_status[1] = DOOR_LOCKED;
-  door_status[2] = DOOR_LOCKED;
-  door_status[3] = DOOR_LOCKED;
-  turn_status[0] = OFF;
-  turn_status[1] = OFF;
+void init_car_state(struct cluster *c) {
+  c->door_status[0] = DOOR_LOCKED;
+  c->door_status[1] = DOOR_LOCKED;
+  c->door_status[2] = DOOR_LOCKED;
+  c->door_status[3] = DOOR_LOCKED;
+  c->turn_status[0] = OFF;
+  c->turn_status[1] = OFF;
+  c->widgets[WIDGET_SPEEDO].state = c->widgets[WIDGET_SPEEDO].drawn = 0;
+  c->widgets[WIDGET_SIGNALS].state = c->widgets[WIDGET_SIGNALS].drawn = 0;
+  c->widgets[WIDGET_DOORS].state = c->widgets[WIDGET_DOORS].drawn = ALL_DOORS_LOCKED;
+}
+
+/* Needle angle for a speed, this is the speedo's widget state */
+int speed_angle(long speed) {
+  long angle = map(speed, 0, 280, 0, 180);
+  if(angle < 0) angle = 0;
+  if(angle > 180) angle = 180;
+  return angle;
 }
 
 /* Empty IC */
-void blank_ic() {
-  SDL_RenderCopy(renderer, base_texture, NULL, NULL);
+void blank_ic(struct cluster *c) {
+  SDL_RenderCopy(c->renderer, c->base_texture, NULL, NULL);
 }
 
 /* Updates speedo */
-void update_speed() {
+void update_speed(struct cluster *c) {
   SDL_Rect dial_rect;
   SDL_Point center;
   double angle = 0;
@@ -111,38 +272,36 @@ void update_speed() {
   dial_rect.y = 80;
   dial_rect.h = 130;
   dial_rect.w = 300;
-  SDL_RenderCopy(renderer, base_texture, &dial_rect, &dial_rect);
+  SDL_RenderCopy(c->renderer, c->base_texture, &dial_rect, &dial_rect);
   /* Because it's a curve we do a smaller rect for the top */
   dial_rect.x = 250;
   dial_rect.y = 30;
   dial_rect.h = 65;
   dial_rect.w = 200;
-  SDL_RenderCopy(renderer, base_texture, &dial_rect, &dial_rect);
+  SDL_RenderCopy(c->renderer, c->base_texture, &dial_rect, &dial_rect);
   // And one more smaller box for the pivot point of the needle
   dial_rect.x = 323;
   dial_rect.y = 171;
   dial_rect.h = 52;
   dial_rect.w = 47;
-  SDL_RenderCopy(renderer, base_texture, &dial_rect, &dial_rect);
+  SDL_RenderCopy(c->renderer, c->base_texture, &dial_rect, &dial_rect);
   center.x = 135;
   center.y = 20;
-  angle = map(current_speed, 0, 280, 0, 180);
-  if(angle < 0) angle = 0;
-  if(angle > 180) angle = 180;
-  SDL_RenderCopyEx(renderer, needle_tex, NULL, &speed_rect, angle, &center, SDL_FLIP_NONE);
+  angle = c->widgets[WIDGET_SPEEDO].drawn;
+  SDL_RenderCopyEx(c->renderer, c->needle_tex, NULL, &speed_rect, angle, &center, SDL_FLIP_NONE);
 }
 
 /* Updates door unlocks simulated by door open icons */
-void update_doors() {
+void update_doors(struct cluster *c) {
   SDL_Rect door_area, update, pos;
   door_area.x = 390;
   door_area.y = 215;
   door_area.w = 110;
   door_area.h = 85;
-  SDL_RenderCopy(renderer, base_texture, &door_area, &door_area);
+  SDL_RenderCopy(c->renderer, c->base_texture, &door_area, &door_area);
   // No update if all doors are locked
-  if(door_status[0] == DOOR_LOCKED && door_status[1] == DOOR_LOCKED &&
-     door_status[2] == DOOR_LOCKED && door_status[3] == DOOR_LOCKED) return;
+  if(c->door_status[0] == DOOR_LOCKED && c->door_status[1] == DOOR_LOCKED &&
+     c->door_status[2] == DOOR_LOCKED && c->door_status[3] == DOOR_LOCKED) return;
   // Make the base body red if even one door is unlocked
   update.x = 440;
   update.y = 239;
@@ -151,8 +310,8 @@ void update_doors() {
   memcpy(&pos, &update, sizeof(SDL_Rect));
   pos.x -= 22;
   pos.y -= 22;
-  SDL_RenderCopy(renderer, sprite_tex, &update, &pos);
-  if(door_status[0] == DOOR_UNLOCKED) {
+  SDL_RenderCopy(c->renderer, c->sprite_tex, &update, &pos);
+  if(c->door_status[0] == DOOR_UNLOCKED) {
     update.x = 420;
     update.y = 263;
     update.w = 21;
@@ -160,9 +319,9 @@ void update_doors() {
     memcpy(&pos, &update, sizeof(SDL_Rect));
     pos.x -= 22;
     pos.y -= 22;
-    SDL_RenderCopy(renderer, sprite_tex, &update, &pos);
+    SDL_RenderCopy(c->renderer, c->sprite_tex, &update, &pos);
   }
-  if(door_status[1] == DOOR_UNLOCKED) {
+  if(c->door_status[1] == DOOR_UNLOCKED) {
     update.x = 484;
     update.y = 261;
     update.w = 21;
@@ -170,9 +329,9 @@ void update_doors() {
     memcpy(&pos, &update, sizeof(SDL_Rect));
     pos.x -= 22;
     pos.y -= 22;
-    SDL_RenderCopy(renderer, sprite_tex, &update, &pos);
+    SDL_RenderCopy(c->renderer, c->sprite_tex, &update, &pos);
   }
-  if(door_status[2] == DOOR_UNLOCKED) {
+  if(c->door_status[2] == DOOR_UNLOCKED) {
     update.x = 420;
     update.y = 284;
     update.w = 21;
@@ -180,9 +339,9 @@ void update_doors() {
     memcpy(&pos, &update, sizeof(SDL_Rect));
     pos.x -= 22;
     pos.y -= 22;
-    SDL_RenderCopy(renderer, sprite_tex, &update, &pos);
+    SDL_RenderCopy(c->renderer, c->sprite_tex, &update, &pos);
   }
-  if(door_status[3] == DOOR_UNLOCKED) {
+  if(c->door_status[3] == DOOR_UNLOCKED) {
     update.x = 484;
     update.y = 287;
     update.w = 21;
@@ -190,12 +349,12 @@ void update_doors() {
     memcpy(&pos, &update, sizeof(SDL_Rect));
     pos.x -= 22;
     pos.y -= 22;
-    SDL_RenderCopy(renderer, sprite_tex, &update, &pos);
+    SDL_RenderCopy(c->renderer, c->sprite_tex, &update, &pos);
   }
 }
 
 /* Updates turn signals */
-void update_turn_signals() {
+void update_turn_signals(struct cluster *c) {
   SDL_Rect left, right, lpos, rpos;
   left.x = 213;
   left.y = 51;
@@ -209,121 +368,1030 @@ void update_turn_signals() {
   lpos.y -= 22;
   rpos.x -= 22;
   rpos.y -= 22;
-  if(turn_status[0] == OFF) {
-	SDL_RenderCopy(renderer, base_texture, &lpos, &lpos);
+  if(c->turn_status[0] == OFF) {
+	SDL_RenderCopy(c->renderer, c->base_texture, &lpos, &lpos);
   } else {
-	SDL_RenderCopy(renderer, sprite_tex, &left, &lpos);
+	SDL_RenderCopy(c->renderer, c->sprite_tex, &left, &lpos);
   }
-  if(turn_status[1] == OFF) {
-	SDL_RenderCopy(renderer, base_texture, &rpos, &rpos);
+  if(c->turn_status[1] == OFF) {
+	SDL_RenderCopy(c->renderer, c->base_texture, &rpos, &rpos);
   } else {
-	SDL_RenderCopy(renderer, sprite_tex, &right, &rpos);
+	SDL_RenderCopy(c->renderer, c->sprite_tex, &right, &rpos);
   }
 }
 
-/* Redraws the IC updating everything 
+void draw_speedo(struct cluster *c, int angle) {
+  (void)angle; // update_speed() reads the drawn angle
+  update_speed(c);
+}
+
+void draw_signals(struct cluster *c, int state) {
+  c->turn_status[0] = (state & CAN_LEFT_SIGNAL) ? ON : OFF;
+  c->turn_status[1] = (state & CAN_RIGHT_SIGNAL) ? ON : OFF;
+  update_turn_signals(c);
+}
+
+void draw_doors(struct cluster *c, int state) {
+  c->door_status[0] = (state & CAN_DOOR1_LOCK) ? DOOR_LOCKED : DOOR_UNLOCKED;
+  c->door_status[1] = (state & CAN_DOOR2_LOCK) ? DOOR_LOCKED : DOOR_UNLOCKED;
+  c->door_status[2] = (state & CAN_DOOR3_LOCK) ? DOOR_LOCKED : DOOR_UNLOCKED;
+  c->door_status[3] = (state & CAN_DOOR4_LOCK) ? DOOR_LOCKED : DOOR_UNLOCKED;
+  update_doors(c);
+}
+
+/* Puts the retained canvas on screen
+ * Headless clusters are only ever looked at through snapshots
+ */
+void present_canvas(struct cluster *c) {
+  c->presents++;
+  if(headless) return;
+  SDL_RenderCopy(c->renderer, c->canvas, NULL, NULL);
+  SDL_RenderPresent(c->renderer);
+}
+
+/* Redraws the IC updating everything
  * Slowest way to go.  Should only use on init
  */
-void redraw_ic() {
-  blank_ic();
-  update_speed();
-  update_doors();
-  update_turn_signals();
-  SDL_RenderPresent(renderer);
+void redraw_ic(struct cluster *c) {
+  SDL_SetRenderTarget(c->renderer, c->canvas);
+  blank_ic(c);
+  update_speed(c);
+  update_doors(c);
+  update_turn_signals(c);
+  SDL_SetRenderTarget(c->renderer, NULL);
+  present_canvas(c);
+}
+
+/* Flags a widget for redraw
+ * Only the first change after a present needs to wake the renderer
+ */
+static __thread int wake_renderer = 0;
+void mark_dirty(struct cluster *c, int widget) {
+  if(!atomic_fetch_or(&c->dirty, widget)) wake_renderer = 1;
+}
+
+uint64_t realtime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Queues the timestamps of the frame being decoded for the renderer to
+ * close once the change it made is presented
+ */
+void push_lat_sample(struct cluster *c) {
+  unsigned int head = atomic_load_explicit(&c->lat_head, memory_order_relaxed);
+
+  if(head - atomic_load_explicit(&c->lat_tail, memory_order_acquire) >= LAT_RING) {
+    atomic_fetch_add_explicit(&c->lat_overruns, 1, memory_order_relaxed);
+    return;
+  }
+  c->lat_ring[head % LAT_RING].kernel_ns = c->rx_kernel_ns;
+  c->lat_ring[head % LAT_RING].decode_ns = c->rx_decode_ns;
+  atomic_store_explicit(&c->lat_head, head + 1, memory_order_release);
+}
+
+/* Records decode -> present and total latency for every change the
+ * last present put on screen
+ */
+void drain_lat_samples(struct cluster *c) {
+  unsigned int tail = atomic_load_explicit(&c->lat_tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&c->lat_head, memory_order_acquire);
+  uint64_t now = realtime_ns();
+  struct lat_sample *s;
+
+  for(; tail != head; tail++) {
+    s = &c->lat_ring[tail % LAT_RING];
+    hist_record(&c->lat_present, now > s->decode_ns ? now - s->decode_ns : 0);
+    if(s->kernel_ns)
+      hist_record(&c->lat_total, now > s->kernel_ns ? now - s->kernel_ns : 0);
+  }
+  atomic_store_explicit(&c->lat_tail, tail, memory_order_release);
+}
+
+/* Publishes a decoded widget state
+ * Repeated identical frames are the common case and don't cause a redraw
+ */
+void set_widget_state(struct cluster *c, int id, int state) {
+  struct widget_state *w = &c->widgets[id];
+
+  if(atomic_exchange(&w->state, state) == state) {
+    w->unchanged++;
+    return;
+  }
+  // Queued before the dirty bit so the renderer can't miss it
+  if(measure_latency) push_lat_sample(c);
+  mark_dirty(c, 1 << id);
 }
 
 /* Parses CAN fram and updates current_speed */
-void update_speed_status(struct canfd_frame *cf, int maxdlen) {
+void update_speed_status(void *arg, struct canfd_frame *cf, int maxdlen) {
+  struct cluster_signal *sig = arg;
+  struct cluster *c = sig->c;
   int len = (cf->len > maxdlen) ? maxdlen : cf->len;
-  if(len < speed_pos + 1) return;
-  if (model) {
-	if (!strncmp(model, "bmw", 3)) {
-		current_speed = (((cf->data[speed_pos + 1] - 208) * 256) + cf->data[speed_pos]) / 16;
-	}
-  } else {
-	  int speed = cf->data[speed_pos] << 8;
-	  speed += cf->data[speed_pos + 1];
-	  speed = speed / 100; // speed in kilometers
-	  current_speed = speed * 0.6213751; // mph
-  }
-  update_speed();
-  SDL_RenderPresent(renderer);
+  if(len < sig->plan.min_len) return;
+  c->current_speed = signal_decode(&sig->plan, cf->data); // mph
+  set_widget_state(c, WIDGET_SPEEDO, speed_angle(c->current_speed));
 }
 
 /* Parses CAN frame and updates turn signal status */
-void update_signal_status(struct canfd_frame *cf, int maxdlen) {
+void update_signal_status(void *arg, struct canfd_frame *cf, int maxdlen) {
+  struct cluster_signal *sig = arg;
+  int len = (cf->len > maxdlen) ? maxdlen : cf->len;
+  if(len < sig->plan.min_len) return;
+  set_widget_state(sig->c, WIDGET_SIGNALS, (int)signal_decode(&sig->plan, cf->data) & (CAN_LEFT_SIGNAL | CAN_RIGHT_SIGNAL));
+}
+
+/* Parses CAN frame and updates door status */
+void update_door_status(void *arg, struct canfd_frame *cf, int maxdlen) {
+  struct cluster_signal *sig = arg;
   int len = (cf->len > maxdlen) ? maxdlen : cf->len;
-  if(len < signal_pos) return;
-  if(cf->data[signal_pos] & CAN_LEFT_SIGNAL) {
-    turn_status[0] = ON;
+  if(len < sig->plan.min_len) return;
+  set_widget_state(sig->c, WIDGET_DOORS, (int)signal_decode(&sig->plan, cf->data) & ALL_DOORS_LOCKED);
+}
+
+/* Repaints the widgets whose state changed since the last present into
+ * the canvas and merges all of their damage into a single present
+ * Called from the SDL thread only
+ */
+void render_dirty(struct cluster *c) {
+  int changed = atomic_exchange(&c->dirty, 0);
+  SDL_Rect damage;
+  struct widget_state *w;
+  int i, state, painted = 0;
+
+  if(!changed) return;
+  SDL_SetRenderTarget(c->renderer, c->canvas);
+  for(i = 0; i < NUM_WIDGETS; i++) {
+    if(!(changed & (1 << i))) continue;
+    w = &c->widgets[i];
+    state = atomic_load(&w->state);
+    if(state == w->drawn) {
+      w->stale++;
+      continue;
+    }
+    w->drawn = state;
+    widgets[i].draw(c, state);
+    w->redraws++;
+    if(painted++) SDL_UnionRect(&damage, &widgets[i].damage, &damage);
+    else damage = widgets[i].damage;
+  }
+  SDL_SetRenderTarget(c->renderer, NULL);
+  if(painted) {
+    present_canvas(c);
+    c->damaged_px += damage.w * damage.h;
+  }
+  if(measure_latency) drain_lat_samples(c);
+}
+
+void print_render_stats(struct cluster *c) {
+  struct widget_state *w;
+  int i;
+
+  for(i = 0; i < NUM_WIDGETS; i++) {
+    w = &c->widgets[i];
+    printf("Widget %-8s    redraws: %lu  skipped: %lu\n", widgets[i].name, w->redraws, w->unchanged + w->stale);
+  }
+  printf("Presents:           %lu\n", c->presents);
+  if(c->presents)
+    printf("Avg damage/present: %lu px\n", c->damaged_px / c->presents);
+}
+
+void print_latency(char *name, struct histogram *h) {
+  printf("%-16s %9.1f %9.1f %9.1f %9lu\n", name,
+         hist_percentile(h, 50) / 1000.0, hist_percentile(h, 99) / 1000.0,
+         hist_percentile(h, 99.9) / 1000.0, (unsigned long)atomic_load(&h->samples));
+}
+
+/* Dumps the latency percentiles of every cluster
+ * Safe to call while the RX workers are recording
+ */
+void print_latency_stats() {
+  struct cluster *c;
+  int i;
+
+  for(i = 0; i < nclusters; i++) {
+    c = &clusters[i];
+    if(nclusters > 1) printf("== %s ==\n", c->ifname);
+    printf("Latency (us)           p50       p99      p999   samples\n");
+    print_latency("kernel->decode", &c->lat_decode);
+    print_latency("decode->present", &c->lat_present);
+    print_latency("total", &c->lat_total);
+    if(c->lat_overruns)
+      printf("Samples dropped:   %lu\n", (unsigned long)atomic_load(&c->lat_overruns));
+  }
+  fflush(stdout);
+}
+
+/* Pulls the SOL_SOCKET control messages of one received frame */
+void read_rx_meta(struct msghdr *msg, struct rx_meta *meta) {
+  struct cmsghdr *cmsg;
+
+  memset(meta, 0, sizeof(*meta));
+  for (cmsg = CMSG_FIRSTHDR(msg);
+       cmsg && (cmsg->cmsg_level == SOL_SOCKET);
+       cmsg = CMSG_NXTHDR(msg,cmsg)) {
+    if (cmsg->cmsg_type == SO_TIMESTAMPNS)
+      memcpy(&meta->ts, CMSG_DATA(cmsg), sizeof(meta->ts));
+    else if (cmsg->cmsg_type == SO_RXQ_OVFL)
+      memcpy(&meta->dropcnt, CMSG_DATA(cmsg), sizeof(meta->dropcnt));
+  }
+}
+
+/* Wakes the render loop if this batch made the first change since the
+ * last present.  Later changes just merge into the pending redraw.
+ */
+void notify_renderer() {
+  uint64_t one = 1;
+
+  if(!wake_renderer) return;
+  wake_renderer = 0;
+  if(write(render_fd, &one, sizeof(one)) != sizeof(one)) perror("write");
+}
+
+/* CAN receive worker
+ * Drains the sockets of its clusters in batches and decodes straight into
+ * their vehicle state mailboxes so ingestion never waits on the renderer
+ */
+void *rx_thread(void *arg) {
+  struct rx_worker *wk = arg;
+  struct canfd_frame frames[RX_BATCH];
+  struct sockaddr_can addrs[RX_BATCH];
+  struct iovec iovs[RX_BATCH];
+  struct mmsghdr msgs[RX_BATCH];
+  struct rx_meta metas[RX_BATCH];
+  char ctrlmsgs[RX_BATCH][CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(__u32))];
+  struct epoll_event events[RX_BATCH];
+  struct can_bus *b;
+  struct cluster *c;
+  int i, j, nfds, nframes, maxdlen;
+
+  memset(msgs, 0, sizeof(msgs));
+  for(i = 0; i < RX_BATCH; i++) {
+	iovs[i].iov_base = &frames[i];
+	iovs[i].iov_len = sizeof(frames[i]);
+	msgs[i].msg_hdr.msg_name = &addrs[i];
+	msgs[i].msg_hdr.msg_iov = &iovs[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+	msgs[i].msg_hdr.msg_control = ctrlmsgs[i];
+  }
+
+  while(1) {
+    nfds = epoll_wait(wk->epfd, events, RX_BATCH, -1);
+    if(nfds < 0) {
+      if(errno == EINTR) continue;
+      perror("epoll_wait");
+      exit(1);
+    }
+    for(j = 0; j < nfds; j++) {
+      if(events[j].data.ptr == wk) return NULL; // rx_stop_fd
+      b = events[j].data.ptr;
+      c = b->c;
+      b->rx_wakeups++;
+      // The kernel overwrites these on every call
+      for(i = 0; i < RX_BATCH; i++) {
+	msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+	msgs[i].msg_hdr.msg_controllen = sizeof(ctrlmsgs[i]);
+	msgs[i].msg_hdr.msg_flags = 0;
+      }
+      nframes = recvmmsg(b->can, msgs, RX_BATCH, MSG_DONTWAIT, NULL);
+      if (nframes < 0) {
+        if(errno == EAGAIN) continue;
+        perror("read");
+        exit(1);
+      }
+      atomic_fetch_add_explicit(&b->rx_frames, nframes, memory_order_relaxed);
+      // One decode timestamp per batch, the frames are decoded right away
+      if(measure_latency) c->rx_decode_ns = realtime_ns();
+      for(i = 0; i < nframes; i++) {
+        if (msgs[i].msg_len == CAN_MTU)
+          maxdlen = CAN_MAX_DLEN;
+        else if (msgs[i].msg_len == CANFD_MTU)
+          maxdlen = CANFD_MAX_DLEN;
+        else {
+          fprintf(stderr, "read: incomplete CAN frame\n");
+          exit(1);
+        }
+        read_rx_meta(&msgs[i].msg_hdr, &metas[i]);
+        // The count is the socket's running total, only sent once it's non zero
+        if(metas[i].dropcnt != b->rx_dropcnt && metas[i].dropcnt) {
+          atomic_fetch_add_explicit(&b->rx_drops, (__u32)(metas[i].dropcnt - b->rx_dropcnt), memory_order_relaxed);
+          b->rx_dropcnt = metas[i].dropcnt;
+        }
+        if(measure_latency) {
+          c->rx_kernel_ns = (uint64_t)metas[i].ts.tv_sec * 1000000000ULL + metas[i].ts.tv_nsec;
+          if(c->rx_kernel_ns)
+            hist_record(&c->lat_decode, c->rx_decode_ns > c->rx_kernel_ns ? c->rx_decode_ns - c->rx_kernel_ns : 0);
+        }
+        if(debug) fprint_canframe(stdout, &frames[i], "\n", 0, maxdlen);
+        dispatch_frame(&b->dispatch, &frames[i], maxdlen);
+      }
+    }
+    notify_renderer();
+  }
+  return NULL;
+}
+
+/* Registers the decoders of the signals each bus carries, an ID may
+ * feed several of them
+ */
+void setup_dispatch(struct cluster *c) {
+  static const dispatch_fn decoders[NUM_SIGNALS] = {
+    [SIGNAL_SPEED] = update_speed_status,
+    [SIGNAL_TURN] = update_signal_status,
+    [SIGNAL_DOOR] = update_door_status,
+  };
+  // Same order as before buses had their own tables
+  static const int order[NUM_SIGNALS] = { SIGNAL_DOOR, SIGNAL_TURN, SIGNAL_SPEED };
+  struct cluster_signal *sig;
+  struct can_bus *b;
+  int i, j;
+
+  for(i = 0; i < c->nbuses; i++) {
+    b = &c->buses[i];
+    dispatch_init(&b->dispatch);
+    for(j = 0; j < NUM_SIGNALS; j++) {
+      if(!(b->signals & (1 << order[j]))) continue;
+      sig = &c->signals[order[j]];
+      if(dispatch_add(&b->dispatch, sig->plan.id, decoders[order[j]], sig) < 0) {
+        printf("Could not allocate the CAN ID dispatch table\n");
+        exit(1);
+      }
+    }
+  }
+}
+
+/* Installs a CAN_RAW_FILTER matching only the IDs decoded from the bus
+ * so the kernel drops background traffic before it wakes us up
+ * Must be called again whenever the active IDs change
+ */
+void set_can_filter(struct can_bus *b) {
+  struct can_filter *rfilter;
+  canid_t *ids;
+  int i, count;
+
+  ids = calloc(b->dispatch.nids, sizeof(*ids));
+  rfilter = calloc(b->dispatch.nids, sizeof(*rfilter));
+  if(!ids || !rfilter) {
+    printf("Could not allocate the CAN filter\n");
+    exit(1);
+  }
+  count = dispatch_ids(&b->dispatch, ids, b->dispatch.nids);
+  for(i = 0; i < count; i++) {
+    rfilter[i].can_id = ids[i];
+    if(ids[i] & CAN_EFF_FLAG)
+      rfilter[i].can_mask = CAN_EFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+    else
+      rfilter[i].can_mask = CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+  }
+  if(setsockopt(b->can, SOL_CAN_RAW, CAN_RAW_FILTER, rfilter, count * sizeof(struct can_filter)) < 0) {
+    perror("setsockopt CAN_RAW_FILTER");
+    exit(1);
+  }
+  free(ids);
+  free(rfilter);
+}
+
+/* Frames seen on the interface, used to measure what the filter saves
+ * Returns 0 if the counter is not available
+ */
+unsigned long read_if_rx_packets(char *ifname) {
+  char path[IFNAMSIZ + 64];
+  unsigned long packets = 0;
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/rx_packets", ifname);
+  fp = fopen(path, "r");
+  if(!fp) return 0;
+  if(fscanf(fp, "%lu", &packets) != 1) packets = 0;
+  fclose(fp);
+  return packets;
+}
+
+void print_rx_stats(struct can_bus *b, unsigned long bus_frames) {
+  printf("Frames on bus:      %lu\n", bus_frames);
+  printf("Frames delivered:   %lu\n", (unsigned long)atomic_load(&b->rx_frames));
+  printf("Frames dropped:     %lu\n", (unsigned long)atomic_load(&b->rx_drops));
+  printf("RX wakeups:         %lu\n", b->rx_wakeups);
+  if(bus_frames && b->rx_wakeups)
+    printf("Wakeup reduction:   %.1fx (%s kernel filter)\n",
+           (double)bus_frames / b->rx_wakeups, use_filter ? "with" : "without");
+}
+
+/* One line per bus with the receive counters, totals and the change
+ * since the last report
+ */
+void print_live_stats() {
+  unsigned long frames, drops;
+  struct can_bus *b;
+  int i, j;
+
+  for(i = 0; i < nclusters; i++) {
+    for(j = 0; j < clusters[i].nbuses; j++) {
+      b = &clusters[i].buses[j];
+      frames = atomic_load_explicit(&b->rx_frames, memory_order_relaxed);
+      drops = atomic_load_explicit(&b->rx_drops, memory_order_relaxed);
+      if(nclusters > 1 && clusters[i].nbuses > 1) printf("%s/", clusters[i].ifname);
+      printf("%s: frames %lu (+%lu) dropped %lu (+%lu)\n", b->ifname,
+             frames, frames - b->live_frames, drops, drops - b->live_drops);
+      b->live_frames = frames;
+      b->live_drops = drops;
+    }
+  }
+  fflush(stdout);
+}
+
+/* Returns the fd SDL reads window system events from or -1 if the
+ * video driver doesn't expose one.  Without it input has to be polled.
+ */
+int get_sdl_fd(SDL_Window *window) {
+#ifdef SDL_VIDEO_DRIVER_X11
+  SDL_SysWMinfo info;
+
+  SDL_VERSION(&info.version);
+  if(window && SDL_GetWindowWMInfo(window, &info) && info.subsystem == SDL_SYSWM_X11)
+    return ConnectionNumber(info.info.x11.display);
+#else
+  (void)window;
+#endif
+  return -1;
+}
+
+/* Time between presents, one display refresh */
+uint64_t get_frame_ns(SDL_Window *window) {
+  SDL_DisplayMode mode;
+  int refresh = DEFAULT_REFRESH;
+
+  if(window && SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &mode) == 0 && mode.refresh_rate > 0)
+    refresh = mode.refresh_rate;
+  return 1000000000ULL / refresh;
+}
+
+/* Drains the SDL event queue, returns 0 once the user quits */
+int handle_sdl_events() {
+  SDL_Event event;
+  int running = 1;
+  int i;
+
+  while( SDL_PollEvent(&event) != 0 ) {
+	switch(event.type) {
+	    case SDL_QUIT:
+		running = 0;
+		break;
+	    case SDL_WINDOWEVENT:
+	    switch(event.window.event) {
+		case SDL_WINDOWEVENT_ENTER:
+		case SDL_WINDOWEVENT_RESIZED:
+			for(i = 0; i < nclusters; i++)
+				if(SDL_GetWindowID(clusters[i].window) == event.window.windowID)
+					present_canvas(&clusters[i]);
+		break;
+	    }
+   	}
+  }
+  return running;
+}
+
+void epoll_add(int epfd, int fd, void *ptr) {
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  if(ptr) ev.data.ptr = ptr;
+  else ev.data.fd = fd;
+  if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    perror("epoll_ctl");
+    exit(1);
+  }
+}
+
+/* Copies name to out with its first %lu replaced by n, the name is never
+ * used as a format so any other % in it is kept as is
+ */
+void expand_count(char *out, size_t size, char *name, unsigned long n) {
+  char *tok = strstr(name, "%lu");
+
+  if(tok) snprintf(out, size, "%.*s%lu%s", (int)(tok - name), name, n, tok + 3);
+  else snprintf(out, size, "%s", name);
+}
+
+/* Writes a headless cluster's canvas to snapshot_path
+ * A .png suffix saves a PNG, anything else the raw ARGB8888 pixels.
+ * A %lu in the path is replaced by the snapshot number.  With several
+ * clusters the interface name is put in front of the file name.
+ */
+void take_snapshot(struct cluster *c) {
+  char path[512], *base;
+  FILE *fp;
+  int y, ok = 1;
+  size_t plen;
+
+  if(!snapshot_path || !screen) return;
+  if(nclusters > 1) {
+    base = strrchr(snapshot_path, '/');
+    base = base ? base + 1 : snapshot_path;
+    snprintf(path, sizeof(path), "%.*s%s-", (int)(base - snapshot_path), snapshot_path, c->ifname);
+    plen = strlen(path);
+    expand_count(path + plen, sizeof(path) - plen, base, c->snapshots);
   } else {
-    turn_status[0] = OFF;
+    expand_count(path, sizeof(path), snapshot_path, c->snapshots);
   }
-  if(cf->data[signal_pos] & CAN_RIGHT_SIGNAL) {
-    turn_status[1] = ON;
+  // Headless clusters share the screen surface, read this one's canvas into it
+  SDL_SetRenderTarget(c->renderer, c->canvas);
+  ok = SDL_RenderReadPixels(c->renderer, NULL, screen->format->format, screen->pixels, screen->pitch) == 0;
+  SDL_SetRenderTarget(c->renderer, NULL);
+  plen = strlen(path);
+  if(!ok) {
+    // Reported below
+  } else if(plen > 4 && !strcasecmp(path + plen - 4, ".png")) {
+    ok = IMG_SavePNG(screen, path) == 0;
   } else {
-    turn_status[1] = OFF;
+    fp = fopen(path, "wb");
+    if(!fp) {
+      ok = 0;
+    } else {
+      for(y = 0; y < screen->h && ok; y++)
+        ok = fwrite((Uint8 *)screen->pixels + y * screen->pitch, 4, screen->w, fp) == (size_t)screen->w;
+      if(fclose(fp)) ok = 0;
+    }
   }
-  update_turn_signals();
-  SDL_RenderPresent(renderer);
+  if(!ok) fprintf(stderr, "Could not write snapshot %s\n", path);
+  c->snapshots++;
 }
 
-/* Parses CAN frame and updates door status */
-void update_door_status(struct canfd_frame *cf, int maxdlen) {
-  int len = (cf->len > maxdlen) ? maxdlen : cf->len;
-  if(len < door_pos) return;
-  if(cf->data[door_pos] & CAN_DOOR1_LOCK) {
-	door_status[0] = DOOR_LOCKED;
-  } else {
-	door_status[0] = DOOR_UNLOCKED;
+/* Opens, configures and binds a raw CAN socket for each of the cluster's
+ * buses
+ */
+void open_can(struct cluster *c) {
+  struct ifreq ifr;
+  struct sockaddr_can addr;
+  struct can_bus *b;
+  int i;
+
+  for(i = 0; i < c->nbuses; i++) {
+    b = &c->buses[i];
+    // Create a new raw CAN socket
+    b->can = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if(b->can < 0) {
+      perror("socket");
+      exit(1);
+    }
+
+    addr.can_family = AF_CAN;
+    memset(&ifr.ifr_name, 0, sizeof(ifr.ifr_name));
+    strncpy(ifr.ifr_name, b->ifname, IFNAMSIZ - 1);
+    printf("Using CAN interface %s\n", ifr.ifr_name);
+    if (ioctl(b->can, SIOCGIFINDEX, &ifr) < 0) {
+      perror("SIOCGIFINDEX");
+      exit(1);
+    }
+    addr.can_ifindex = ifr.ifr_ifindex;
+    // CAN FD Mode
+    setsockopt(b->can, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &canfd_on, sizeof(canfd_on));
+    // Report frames dropped on a full receive queue with every frame
+    if(setsockopt(b->can, SOL_SOCKET, SO_RXQ_OVFL, &canfd_on, sizeof(canfd_on)) < 0)
+      perror("setsockopt SO_RXQ_OVFL");
+    // Kernel receive timestamps for the latency histograms
+    if(measure_latency && setsockopt(b->can, SOL_SOCKET, SO_TIMESTAMPNS, &canfd_on, sizeof(canfd_on)) < 0)
+      perror("setsockopt SO_TIMESTAMPNS");
+
+    if (bind(b->can, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      perror("bind");
+      exit(1);
+    }
+  }
+  hist_init(&c->lat_decode);
+  hist_init(&c->lat_present);
+  hist_init(&c->lat_total);
+}
+
+/* Adds a bus to a cluster from "<can>[:signal,...]"
+ * Without a signal list every signal is decoded from it
+ * Returns 0 on success, -1 on a bad spec
+ */
+int add_bus(struct cluster *c, char *spec) {
+  struct can_bus *b;
+  char *list, *name, *save = NULL;
+  int i;
+
+  if(c->nbuses >= MAX_BUSES) {
+    printf("Too many CAN interfaces for one cluster, max is %d\n", MAX_BUSES);
+    return -1;
+  }
+  b = &c->buses[c->nbuses];
+  memset(b, 0, sizeof(*b));
+  b->c = c;
+  b->can = -1;
+  list = strchr(spec, ':');
+  if(list) *list++ = '\0';
+  if(!spec[0] || strlen(spec) >= IFNAMSIZ) {
+    printf("Bad CAN interface name %s\n", spec);
+    return -1;
+  }
+  strcpy(b->ifname, spec);
+  if(!list) b->signals = (1 << NUM_SIGNALS) - 1;
+  for(name = list ? strtok_r(list, ",", &save) : NULL; name; name = strtok_r(NULL, ",", &save)) {
+    for(i = 0; i < NUM_SIGNALS && strcmp(name, signal_names[i]); i++);
+    if(i == NUM_SIGNALS) {
+      printf("Unknown signal %s on %s, use speed, signal or door\n", name, b->ifname);
+      return -1;
+    }
+    b->signals |= 1 << i;
+  }
+  if(!b->signals) {
+    printf("No signals listed for %s\n", b->ifname);
+    return -1;
   }
-  if(cf->data[door_pos] & CAN_DOOR2_LOCK) {
-	door_status[1] = DOOR_LOCKED;
+  if(!c->nbuses) strcpy(c->ifname, b->ifname);
+  c->nbuses++;
+  return 0;
+}
+
+/* Compiles the cluster's signals from the database, moving their IDs and
+ * byte positions around when it has a seed
+ */
+void setup_layout(struct cluster *c, int index) {
+  struct signal_def defs[NUM_SIGNALS];
+  int i;
+
+  if (c->model && !signal_db_has_model(&signal_db, c->model)) {
+	printf("Unknown model.  ");
+	signal_db_print_models(&signal_db);
+	exit(3);
+  }
+  // Clusters started in the same second still get their own seed
+  if(c->randomize) c->seed = time(NULL) + index;
+  if(signal_layout(&signal_db, c->model, c->seed, c->fd, defs) < 0) exit(3);
+  if(c->seed) {
+	if(nclusters > 1) printf("%s ", c->ifname);
+	printf("Seed: %d\n", c->seed);
+  }
+  for(i = 0; i < NUM_SIGNALS; i++) {
+	c->signals[i].c = c;
+	signal_compile(&defs[i], &c->signals[i].plan);
+  }
+}
+
+/* Records the seeds so controls can be pointed at them
+ * A single cluster keeps the plain "<seed>" format
+ */
+void save_seeds() {
+  FILE *fdseed = NULL;
+  int i;
+
+  for(i = 0; i < nclusters; i++) {
+    if(!clusters[i].seed) continue;
+    if(!fdseed) fdseed = fopen("/tmp/icsim_seed.txt", "w");
+    if(!fdseed) return;
+    if(nclusters > 1) fprintf(fdseed, "%s ", clusters[i].ifname);
+    fprintf(fdseed, "%d\n", clusters[i].seed);
+  }
+  if(fdseed) fclose(fdseed);
+}
+
+/* Creates the cluster's render target
+ * Windowed clusters need their own renderer and textures, headless ones
+ * share the software renderer and only own their canvas
+ */
+void setup_video(struct cluster *c) {
+  char title[64];
+
+  if(headless) {
+	c->renderer = shared_renderer;
   } else {
-	door_status[1] = DOOR_UNLOCKED;
+	if(nclusters > 1) snprintf(title, sizeof(title), "IC Simulator - %s", c->ifname);
+	else snprintf(title, sizeof(title), "IC Simulator");
+	c->window = SDL_CreateWindow(title, SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT,
+                            SDL_WINDOW_SHOWN); // | SDL_WINDOW_RESIZABLE);
+	if(c->window == NULL) {
+		printf("Window could not be shown\n");
+	}
+	c->renderer = SDL_CreateRenderer(c->window, -1, SDL_RENDERER_TARGETTEXTURE);
+	if(c->renderer == NULL) {
+		printf("Could not create a renderer: %s\n", SDL_GetError());
+		exit(40);
+	}
   }
-  if(cf->data[door_pos] & CAN_DOOR3_LOCK) {
-	door_status[2] = DOOR_LOCKED;
+  if(headless && c != &clusters[0]) {
+	c->base_texture = clusters[0].base_texture;
+	c->needle_tex = clusters[0].needle_tex;
+	c->sprite_tex = clusters[0].sprite_tex;
   } else {
-	door_status[2] = DOOR_UNLOCKED;
+	c->base_texture = SDL_CreateTextureFromSurface(c->renderer, ic_image);
+	c->needle_tex = SDL_CreateTextureFromSurface(c->renderer, needle_image);
+	c->sprite_tex = SDL_CreateTextureFromSurface(c->renderer, sprite_image);
+  }
+  c->canvas = SDL_CreateTexture(c->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, SCREEN_WIDTH, SCREEN_HEIGHT);
+  if(c->canvas == NULL) {
+	printf("Could not create the IC canvas: %s\n", SDL_GetError());
+	exit(40);
   }
-  if(cf->data[door_pos] & CAN_DOOR4_LOCK) {
-	door_status[3] = DOOR_LOCKED;
+}
+
+void free_video(struct cluster *c) {
+  SDL_DestroyTexture(c->canvas);
+  if(headless && c != &clusters[0]) return;
+  SDL_DestroyTexture(c->base_texture);
+  SDL_DestroyTexture(c->needle_tex);
+  SDL_DestroyTexture(c->sprite_tex);
+  if(headless) return;
+  SDL_DestroyRenderer(c->renderer);
+  if(c->window) SDL_DestroyWindow(c->window);
+}
+
+/* Adds a cluster from a -M file line: [-r] [-f] [-s seed] [-m model] <can>[:signals]... */
+int parse_cluster_line(char *line, int lineno) {
+  struct cluster *c;
+  char *tok, *save = NULL;
+
+  tok = strtok_r(line, " \t\r\n", &save);
+  if(!tok || tok[0] == '#') return 0;
+  if(nclusters >= MAX_CLUSTERS) {
+    printf("Too many clusters, max is %d\n", MAX_CLUSTERS);
+    exit(1);
+  }
+  c = &clusters[nclusters];
+  memset(c, 0, sizeof(*c));
+  for(; tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+    if(!strcmp(tok, "-r")) {
+      c->randomize = 1;
+    } else if(!strcmp(tok, "-f")) {
+      c->fd = 1;
+    } else if(!strcmp(tok, "-s") && (tok = strtok_r(NULL, " \t\r\n", &save))) {
+      c->seed = atoi(tok);
+    } else if(!strcmp(tok, "-m") && (tok = strtok_r(NULL, " \t\r\n", &save))) {
+      c->model = strdup(tok);
+    } else if(tok[0] != '-') {
+      if(add_bus(c, tok) < 0) {
+        printf("Cluster file line %d: bad interface %s\n", lineno, tok);
+        return -1;
+      }
+    } else {
+      printf("Cluster file line %d: bad token %s\n", lineno, tok);
+      return -1;
+    }
+  }
+  if(!c->nbuses) {
+    printf("Cluster file line %d: no CAN interface\n", lineno);
+    return -1;
+  }
+  if(c->seed && c->randomize) {
+    printf("Cluster file line %d: can not use a seed AND randomize\n", lineno);
+    return -1;
+  }
+  nclusters++;
+  return 0;
+}
+
+void load_clusters(char *fname) {
+  char line[256];
+  int lineno = 0;
+  FILE *fp = fopen(fname, "r");
+
+  if(!fp) {
+    perror(fname);
+    exit(1);
+  }
+  while(fgets(line, sizeof(line), fp))
+    if(parse_cluster_line(line, ++lineno) < 0) exit(1);
+  fclose(fp);
+  if(!nclusters) {
+    printf("No clusters defined in %s\n", fname);
+    exit(1);
+  }
+}
+
+/* Spreads the clusters over the receive workers, each worker waits on
+ * the sockets of all the buses of its clusters
+ */
+void start_workers(int nthreads) {
+  struct rx_worker *wk;
+  int i, j;
+
+  if(nthreads < 1) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(nthreads > nclusters) nthreads = nclusters;
+  if(nthreads > MAX_WORKERS) nthreads = MAX_WORKERS;
+  if(nthreads < 1) nthreads = 1;
+  nworkers = nthreads;
+  for(i = 0; i < nworkers; i++) {
+    wk = &workers[i];
+    wk->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(wk->epfd < 0) {
+      perror("epoll_create1");
+      exit(41);
+    }
+    // The worker itself stands for rx_stop_fd, buses are the other events
+    epoll_add(wk->epfd, rx_stop_fd, wk);
+  }
+  for(i = 0; i < nclusters; i++) {
+    wk = &workers[i % nworkers];
+    for(j = 0; j < clusters[i].nbuses; j++)
+      epoll_add(wk->epfd, clusters[i].buses[j].can, &clusters[i].buses[j]);
+    wk->nclusters++;
+  }
+  for(i = 0; i < nworkers; i++) {
+    if(pthread_create(&workers[i].tid, NULL, rx_thread, &workers[i]) != 0) {
+      printf("Could not start the CAN receive thread\n");
+      exit(41);
+    }
+  }
+}
+
+void stop_workers() {
+  uint64_t stop = 1;
+  int i;
+
+  // rx_stop_fd is never read so it wakes every worker
+  if(write(rx_stop_fd, &stop, sizeof(stop)) != sizeof(stop)) return;
+  for(i = 0; i < nworkers; i++) {
+    pthread_join(workers[i].tid, NULL);
+    close(workers[i].epfd);
+  }
+}
+
+/* Initializes SDL, loads the shared images and draws every cluster */
+void setup_sdl() {
+  int i;
+
+  if(headless) {
+	// No video subsystem, the software renderer draws into our surface
+	if(SDL_Init(0) < 0) {
+		printf("SDL Could not initializes\n");
+		exit(40);
+	}
+	screen = SDL_CreateRGBSurfaceWithFormat(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, SDL_PIXELFORMAT_ARGB8888);
+	if(screen == NULL) {
+		printf("Could not create the offscreen surface: %s\n", SDL_GetError());
+		exit(40);
+	}
+	shared_renderer = SDL_CreateSoftwareRenderer(screen);
+	if(shared_renderer == NULL) {
+		printf("Could not create a renderer: %s\n", SDL_GetError());
+		exit(40);
+	}
   } else {
-	door_status[3] = DOOR_UNLOCKED;
+	if(SDL_Init ( SDL_INIT_VIDEO ) < 0 ) {
+		printf("SDL Could not initializes\n");
+		exit(40);
+	}
+  }
+  ic_image = IMG_Load(get_data("ic.png"));
+  needle_image = IMG_Load(get_data("needle.png"));
+  sprite_image = IMG_Load(get_data("spritesheet.png"));
+  if(!ic_image || !needle_image || !sprite_image) {
+	printf("Could not load the IC images: %s\n", SDL_GetError());
+	exit(40);
   }
-  update_doors();
-  SDL_RenderPresent(renderer);
+
+  speed_rect.x = 212;
+  speed_rect.y = 175;
+  speed_rect.h = needle_image->h;
+  speed_rect.w = needle_image->w;
+
+  for(i = 0; i < nclusters; i++) {
+	setup_video(&clusters[i]);
+	// Draw the IC
+	redraw_ic(&clusters[i]);
+  }
+}
+
+void free_sdl() {
+  SDL_FreeSurface(ic_image);
+  SDL_FreeSurface(needle_image);
+  SDL_FreeSurface(sprite_image);
+  if(shared_renderer) SDL_DestroyRenderer(shared_renderer);
+  if(screen) SDL_FreeSurface(screen);
+  IMG_Quit();
+  SDL_Quit();
+}
+
+/* Prints a line of the offline timeline */
+void print_timeline(uint64_t ts_ns, struct vehicle_state *vs) {
+  static const char *turn[] = { "off", "left", "right", "hazard" };
+  int i;
+
+  printf("(%lu.%06lu) speed=%ld signal=%s doors=", (unsigned long)(ts_ns / 1000000000ULL),
+         (unsigned long)(ts_ns % 1000000000ULL / 1000), vs->speed, turn[vs->signals & 3]);
+  for(i = 0; i < 4; i++) putchar(vs->doors & (CAN_DOOR1_LOCK << i) ? 'L' : 'U');
+  putchar('\n');
+}
+
+/* Offline decode (-O)
+ * Streams every frame of a capture or candump log straight through the
+ * decoders of the cluster's bus the capture was taken on, the first bus if
+ * none matches, and prints a timeline line each time the vehicle state
+ * changes.  Headless clusters also render every
+ * change.  Throughput goes to stderr so the timeline can be diffed.
+ * Returns 0 on success, 1 if the capture could not be read
+ */
+int decode_capture(struct cluster *c, char *fname) {
+  struct cap_file cap;
+  struct cap_record *rec;
+  struct can_bus *b = &c->buses[0];
+  struct vehicle_state cur, last;
+  uint64_t i, changes = 0, start, secs;
+  int maxdlen;
+
+  if(cap_open(&cap, fname) < 0) return 1;
+  for(i = 1; i < (uint64_t)c->nbuses; i++)
+    if(!strcmp(c->buses[i].ifname, cap.ifname)) b = &c->buses[i];
+  last.speed = atomic_load(&c->current_speed);
+  last.signals = atomic_load(&c->widgets[WIDGET_SIGNALS].state);
+  last.doors = atomic_load(&c->widgets[WIDGET_DOORS].state);
+  if(timeline && cap.count) print_timeline(cap.records[0].ts_ns, &last);
+  start = mono_ns();
+  for(i = 0; i < cap.count; i++) {
+    rec = &cap.records[i];
+    maxdlen = cap_mtu(rec) == CANFD_MTU ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+    if(debug) fprint_canframe(stdout, &rec->cf, "\n", 0, maxdlen);
+    dispatch_frame(&b->dispatch, &rec->cf, maxdlen);
+    cur.speed = atomic_load_explicit(&c->current_speed, memory_order_relaxed);
+    cur.signals = atomic_load_explicit(&c->widgets[WIDGET_SIGNALS].state, memory_order_relaxed);
+    cur.doors = atomic_load_explicit(&c->widgets[WIDGET_DOORS].state, memory_order_relaxed);
+    if(cur.speed == last.speed && cur.signals == last.signals && cur.doors == last.doors) continue;
+    if(timeline) print_timeline(rec->ts_ns, &cur);
+    if(headless) render_dirty(c);
+    last = cur;
+    changes++;
+  }
+  secs = mono_ns() - start;
+  fflush(stdout);
+  fprintf(stderr, "Decoded %lu frames in %.3f s: %.0f frames/s, %lu state changes\n",
+          (unsigned long)cap.count, secs / 1e9, secs ? cap.count * 1e9 / secs : 0.0, (unsigned long)changes);
+  cap_close(&cap);
+  return 0;
+}
+
+/* Decodes offline_file into the first cluster and cleans up */
+int run_offline() {
+  struct cluster *c = &clusters[0];
+  int i, status;
+
+  if(headless) setup_sdl();
+  status = decode_capture(c, offline_file);
+  if(headless) {
+    // Final state, anything still pending is drawn before the snapshot
+    render_dirty(c);
+    take_snapshot(c);
+    if(show_stats) print_render_stats(c);
+    free_video(c);
+    free_sdl();
+  }
+  for(i = 0; i < c->nbuses; i++)
+    dispatch_free(&c->buses[i].dispatch);
+  signal_db_free(&signal_db);
+  return status;
 }
 
 void Usage(char *msg) {
   if(msg) printf("%s\n", msg);
-  printf("Usage: icsim [options] <can>\n");
+  printf("Usage: icsim [options] <can>[:signals] [<can>[:signals]...]\n");
+  printf("       icsim [options] -M <cluster file>\n");
+  printf("       icsim [options] -O <capture> [<can>[:signals]...]\n");
+  printf("\tsignals is a comma separated list of speed, signal and door to\n");
+  printf("\tdecode from that interface, all of them by default\n");
   printf("\t-r\trandomize IDs\n");
   printf("\t-s\tseed value\n");
   printf("\t-d\tdebug mode\n");
   printf("\t-m\tmodel NAME  (Ex: -m bmw)\n");
+  printf("\t-f\tCAN FD layout, speed, signal and door packed in one frame (same as controls -f)\n");
+  printf("\t-D\tsignal database FILE (default: %ssignals.txt)\n", DATA_DIR);
+  printf("\t-F\tdisable the kernel CAN ID filter\n");
+  printf("\t-S\tprint receive and render statistics on exit\n");
+  printf("\t-T\tprint live receive and drop counters every ms\n");
+  printf("\t-E\texit with status 2 if the kernel dropped any frames\n");
+  printf("\t-L\tmeasure receive to screen latency, printed on exit and SIGUSR1\n");
+  printf("\t-H\theadless, render offscreen without a window\n");
+  printf("\t-o\tsnapshot FILE for headless mode (.png or raw ARGB8888, %%lu = count)\n");
+  printf("\t-i\tsnapshot interval in ms (default: only on exit)\n");
+  printf("\t-M\tcluster FILE, one cluster per line: [-r] [-f] [-s seed] [-m model] <can>[:signals]...\n");
+  printf("\t-j\tnumber of receive workers for -M (default: one per core)\n");
+  printf("\t-O\tdecode a capture or candump log FILE offline and print the state timeline\n");
+  printf("\t-q\tno timeline with -O, only the decode throughput\n");
   exit(1);
 }
 
 int main(int argc, char *argv[]) {
   int opt;
-  int can;
-  struct ifreq ifr;
-  struct sockaddr_can addr;
-  struct canfd_frame frame;
-  struct iovec iov;
-  struct msghdr msg;
-  struct cmsghdr *cmsg;
   struct stat dirstat;
-  char ctrlmsg[CMSG_SPACE(sizeof(struct timeval)) + CMSG_SPACE(sizeof(__u32))];
+  struct cluster *c;
+  struct can_bus *b;
   int running = 1;
-  int nbytes, maxdlen;
+  int randomize = 0;
   int seed = 0;
-  canid_t door_id, signal_id, speed_id;
-  SDL_Event event;
+  int fd = 0;
+  char *model = NULL;
+  char *cluster_file = NULL;
+  int nthreads = 0;
+  int epfd, timer_fd, snap_fd = -1, stats_fd = -1, sig_fd, sdl_fd = -1, nfds, i, j, n;
+  int timer_armed = 0, pending, status = 0;
+  uint64_t frame_ns, last_present = 0, now, count;
+  struct itimerspec next_frame, snap_period, stats_period;
+  struct epoll_event events[6];
+  struct signalfd_siginfo siginfo;
+  sigset_t sigs;
 
-  while ((opt = getopt(argc, argv, "rs:dm:h?")) != -1) {
+  while ((opt = getopt(argc, argv, "rs:dfm:D:FST:ELHo:i:M:j:O:qh?")) != -1) {
     switch(opt) {
 	case 'r':
 		randomize = 1;
@@ -334,9 +1402,51 @@ int main(int argc, char *argv[]) {
 	case 'd':
 		debug = 1;
 		break;
+	case 'f':
+		fd = 1;
+		break;
 	case 'm':
 		model = optarg;
 		break;
+	case 'D':
+		signal_file = optarg;
+		break;
+	case 'F':
+		use_filter = 0;
+		break;
+	case 'S':
+		show_stats = 1;
+		break;
+	case 'T':
+		stats_ms = atoi(optarg);
+		break;
+	case 'E':
+		drop_exit = 1;
+		break;
+	case 'L':
+		measure_latency = 1;
+		break;
+	case 'H':
+		headless = 1;
+		break;
+	case 'o':
+		snapshot_path = optarg;
+		break;
+	case 'i':
+		snapshot_ms = atoi(optarg);
+		break;
+	case 'M':
+		cluster_file = optarg;
+		break;
+	case 'j':
+		nthreads = atoi(optarg);
+		break;
+	case 'O':
+		offline_file = optarg;
+		break;
+	case 'q':
+		timeline = 0;
+		break;
 	case 'h':
 	case '?':
 	default:
@@ -345,159 +1455,192 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  if (optind >= argc) Usage("You must specify at least one can device");
+  if (offline_file && (cluster_file || measure_latency || stats_ms))
+	Usage("-O decodes into a single cluster without a CAN bus, -M, -L and -T don't apply");
+  if (cluster_file) {
+	if (optind < argc || randomize || seed || model || fd)
+		Usage("-M takes the interface, seed, model and layout from the cluster file");
+	load_clusters(cluster_file);
+  } else {
+	if (optind >= argc && !offline_file) Usage("You must specify at least one can device");
+
+	if (seed && randomize) Usage("You can not specify a seed value AND randomize the seed");
+
+	c = &clusters[nclusters++];
+	for(; optind < argc; optind++)
+		if(add_bus(c, argv[optind]) < 0) exit(1);
+	if(!c->nbuses) add_bus(c, "offline");
+	c->randomize = randomize;
+	c->seed = seed;
+	c->model = model;
+	c->fd = fd;
+  }
 
-  if (seed && randomize) Usage("You can not specify a seed value AND randomize the seed");
+  if (snapshot_path && !headless) Usage("Snapshots are only taken in headless mode");
 
   // Verify data directory exists
   if(stat(DATA_DIR, &dirstat) == -1) {
   	printf("ERROR: DATA_DIR not found.  Define in make file or run in src dir\n");
 	exit(34);
   }
-  
-  // Create a new raw CAN socket
-  can = socket(PF_CAN, SOCK_RAW, CAN_RAW);
-  if(can < 0) Usage("Couldn't create raw socket");
-
-  addr.can_family = AF_CAN;
-  memset(&ifr.ifr_name, 0, sizeof(ifr.ifr_name));
-  strncpy(ifr.ifr_name, argv[optind], strlen(argv[optind]));
-  printf("Using CAN interface %s\n", ifr.ifr_name);
-  if (ioctl(can, SIOCGIFINDEX, &ifr) < 0) {
-    perror("SIOCGIFINDEX");
-    exit(1);
-  }
-  addr.can_ifindex = ifr.ifr_ifindex;
-  // CAN FD Mode
-  setsockopt(can, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &canfd_on, sizeof(canfd_on));
-
-  iov.iov_base = &frame;
-  iov.iov_len = sizeof(frame);
-  msg.msg_name = &addr;
-  msg.msg_namelen = sizeof(addr);
-  msg.msg_iov = &iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = &ctrlmsg;
-  msg.msg_controllen = sizeof(ctrlmsg);
-  msg.msg_flags = 0;
-
-  if (bind(can, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-	perror("bind");
-	return 1;
-  }
-
-  init_car_state();
-
-  door_id = DEFAULT_DOOR_ID;
-  signal_id = DEFAULT_SIGNAL_ID;
-  speed_id = DEFAULT_SPEED_ID;
-
-  if (randomize || seed) {
-	if(randomize) seed = time(NULL);
-	srand(seed);
-	door_id = (rand() % 2046) + 1;
-	signal_id = (rand() % 2046) + 1;
-	speed_id = (rand() % 2046) + 1;
-	door_pos = rand() % 9;
-	signal_pos = rand() % 9;
-	speed_pos = rand() % 8;
-	printf("Seed: %d\n", seed);
-	FILE *fdseed = fopen("/tmp/icsim_seed.txt", "w");
-	fprintf(fdseed, "%d\n", seed);
-	fclose(fdseed);
-  } else if (model) {
-	if (!strncmp(model, "bmw", 3)) {
-		speed_id = MODEL_BMW_X1_SPEED_ID;
-		speed_pos = MODEL_BMW_X1_SPEED_BYTE;
-	} else {
-		printf("Unknown model.  Acceptable models: bmw\n");
-		exit(3);
-	}
+
+  if(!signal_file) signal_file = get_data("signals.txt");
+  if(signal_db_load(&signal_db, signal_file) < 0) exit(3);
+
+  for(i = 0; i < nclusters; i++) {
+	c = &clusters[i];
+	if(!offline_file) open_can(c);
+	init_car_state(c);
+	setup_layout(c, i);
+	setup_dispatch(c);
+	for(j = 0; j < c->nbuses && use_filter && !offline_file; j++)
+		set_can_filter(&c->buses[j]);
   }
+  if(offline_file) return run_offline();
+  save_seeds();
 
-  SDL_Window *window = NULL;
-  if(SDL_Init ( SDL_INIT_VIDEO ) < 0 ) {
-	printf("SDL Could not initializes\n");
-	exit(40);
+  setup_sdl();
+
+  // SIGINT/SIGTERM end the loop cleanly, headless mode has no window to close
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGUSR1); // Latency dump
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  rx_stop_fd = eventfd(0, EFD_CLOEXEC);
+  render_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  sig_fd = signalfd(-1, &sigs, SFD_CLOEXEC | SFD_NONBLOCK);
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if(rx_stop_fd < 0 || render_fd < 0 || timer_fd < 0 || sig_fd < 0 || epfd < 0) {
+	printf("Could not set up the event loop\n");
+	exit(41);
   }
-  window = SDL_CreateWindow("IC Simulator", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT,
-                            SDL_WINDOW_SHOWN); // | SDL_WINDOW_RESIZABLE);
-  if(window == NULL) {
-	printf("Window could not be shown\n");
+  epoll_add(epfd, render_fd, NULL);
+  epoll_add(epfd, timer_fd, NULL);
+  epoll_add(epfd, sig_fd, NULL);
+  if(!headless) {
+	// All windows share one display connection
+	sdl_fd = get_sdl_fd(clusters[0].window);
+	if(sdl_fd >= 0) epoll_add(epfd, sdl_fd, NULL);
   }
-  renderer = SDL_CreateRenderer(window, -1, 0);
-  SDL_Surface *image = IMG_Load(get_data("ic.png"));
-  SDL_Surface *needle = IMG_Load(get_data("needle.png"));
-  SDL_Surface *sprites = IMG_Load(get_data("spritesheet.png"));
-  base_texture = SDL_CreateTextureFromSurface(renderer, image);
-  needle_tex = SDL_CreateTextureFromSurface(renderer, needle);
-  sprite_tex = SDL_CreateTextureFromSurface(renderer, sprites);
-
-  speed_rect.x = 212;
-  speed_rect.y = 175;
-  speed_rect.h = needle->h;
-  speed_rect.w = needle->w;
+  if(snapshot_path && snapshot_ms > 0) {
+	snap_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if(snap_fd < 0) {
+		printf("Could not set up the snapshot timer\n");
+		exit(41);
+	}
+	snap_period.it_interval.tv_sec = snapshot_ms / 1000;
+	snap_period.it_interval.tv_nsec = (snapshot_ms % 1000) * 1000000L;
+	snap_period.it_value = snap_period.it_interval;
+	timerfd_settime(snap_fd, 0, &snap_period, NULL);
+	epoll_add(epfd, snap_fd, NULL);
+  }
+  if(stats_ms > 0) {
+	stats_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if(stats_fd < 0) {
+		printf("Could not set up the stats timer\n");
+		exit(41);
+	}
+	stats_period.it_interval.tv_sec = stats_ms / 1000;
+	stats_period.it_interval.tv_nsec = (stats_ms % 1000) * 1000000L;
+	stats_period.it_value = stats_period.it_interval;
+	timerfd_settime(stats_fd, 0, &stats_period, NULL);
+	epoll_add(epfd, stats_fd, NULL);
+  }
+  frame_ns = get_frame_ns(clusters[0].window);
+  memset(&next_frame, 0, sizeof(next_frame));
 
-  // Draw the IC
-  redraw_ic();
+  for(i = 0; i < nclusters; i++)
+	for(j = 0; j < clusters[i].nbuses; j++)
+		clusters[i].buses[j].bus_start = read_if_rx_packets(clusters[i].buses[j].ifname);
+  start_workers(cluster_file ? nthreads : 1);
 
-  /* For now we will just operate on one CAN interface */
+  /* The RX workers own the sockets of every bus and signal render_fd when a vehicle
+   * state changes.  Presents are paced to one pass per display refresh by
+   * timer_fd, and window events wake us through the X11 connection.
+   */
   while(running) {
-    while( SDL_PollEvent(&event) != 0 ) {
-	switch(event.type) {
-	    case SDL_QUIT:
-		running = 0;
-		break;
-	    case SDL_WINDOWEVENT:
-	    switch(event.window.event) {
-		case SDL_WINDOWEVENT_ENTER:
-		case SDL_WINDOWEVENT_RESIZED:
-			redraw_ic();
-		break;
-	    }
-   	}
-      SDL_Delay(3);
+    if(!timer_armed) {
+	for(i = 0, pending = 0; i < nclusters && !pending; i++)
+		pending = atomic_load(&clusters[i].dirty);
+	now = mono_ns();
+	if(!pending) {
+		// Nothing to draw
+	} else if(now - last_present >= frame_ns) {
+		for(i = 0; i < nclusters; i++) render_dirty(&clusters[i]);
+		last_present = now;
+	} else {
+		// Too soon since the last present, come back at the next refresh
+		next_frame.it_value.tv_sec = (last_present + frame_ns) / 1000000000ULL;
+		next_frame.it_value.tv_nsec = (last_present + frame_ns) % 1000000000ULL;
+		timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &next_frame, NULL);
+		timer_armed = 1;
+	}
+    }
+    if(!headless) {
+	// Drain SDL last, presenting may have queued window events
+	running = handle_sdl_events();
+	if(!running) break;
+    }
+    nfds = epoll_wait(epfd, events, 6, (headless || sdl_fd >= 0) ? -1 : SDL_POLL_MS);
+    if(nfds < 0 && errno != EINTR) {
+	perror("epoll_wait");
+	break;
+    }
+    for(n = 0; n < nfds; n++) {
+	if(events[n].data.fd == sdl_fd) continue; // Drained by SDL_PollEvent
+	if(events[n].data.fd == sig_fd) {
+		if(read(sig_fd, &siginfo, sizeof(siginfo)) != sizeof(siginfo)) continue;
+		if(siginfo.ssi_signo != SIGUSR1) running = 0;
+		else if(measure_latency) print_latency_stats();
+		continue;
+	}
+	if(read(events[n].data.fd, &count, sizeof(count)) < 0) continue;
+	if(events[n].data.fd == timer_fd) timer_armed = 0;
+	if(events[n].data.fd == snap_fd)
+		for(i = 0; i < nclusters; i++) take_snapshot(&clusters[i]);
+	if(events[n].data.fd == stats_fd) print_live_stats();
     }
+  }
 
-      nbytes = recvmsg(can, &msg, 0);
-      if (nbytes < 0) {
-        perror("read");
-        return 1;
-      }  
-      if ((size_t)nbytes == CAN_MTU)
-        maxdlen = CAN_MAX_DLEN;
-      else if ((size_t)nbytes == CANFD_MTU)
-        maxdlen = CANFD_MAX_DLEN;
-      else {
-        fprintf(stderr, "read: incomplete CAN frame\n");
-        return 1;
-      }
-      for (cmsg = CMSG_FIRSTHDR(&msg);
-           cmsg && (cmsg->cmsg_level == SOL_SOCKET);
-           cmsg = CMSG_NXTHDR(&msg,cmsg)) {
-             if (cmsg->cmsg_type == SO_TIMESTAMP) {
-               // struct timeval tv = *(struct timeval *)CMSG_DATA(cmsg);
-             }
-             else if (cmsg->cmsg_type == SO_RXQ_OVFL)
-               //dropcnt[i] = *(__u32 *)CMSG_DATA(cmsg);
-  	     fprintf(stderr, "Dropped packet\n");
-             }
-//      if(debug) fprint_canframe(stdout, &frame, "\n", 0, maxdlen);
-      if(frame.can_id == door_id) update_door_status(&frame, maxdlen);
-      if(frame.can_id == signal_id) update_signal_status(&frame, maxdlen);
-      if(frame.can_id == speed_id) update_speed_status(&frame, maxdlen);
-  }
-
-  SDL_DestroyTexture(base_texture);
-  SDL_DestroyTexture(needle_tex);
-  SDL_DestroyTexture(sprite_tex);
-  SDL_FreeSurface(image);
-  SDL_FreeSurface(needle);
-  SDL_FreeSurface(sprites);
-  SDL_DestroyRenderer(renderer);
-  SDL_DestroyWindow(window);
-  IMG_Quit();
-  SDL_Quit();
+  stop_workers();
+  close(rx_stop_fd);
+  close(render_fd);
+  close(timer_fd);
+  close(sig_fd);
+  if(snap_fd >= 0) close(snap_fd);
+  if(stats_fd >= 0) close(stats_fd);
+  close(epfd);
+  for(i = 0; i < nclusters; i++) {
+	c = &clusters[i];
+	if(headless) {
+		// Final state, anything still pending is drawn before the snapshot
+		render_dirty(c);
+		take_snapshot(c);
+	}
+	if(show_stats && nclusters > 1) printf("== %s ==\n", c->ifname);
+	for(j = 0; j < c->nbuses; j++) {
+		b = &c->buses[j];
+		if(show_stats) {
+			if(c->nbuses > 1) printf("-- %s --\n", b->ifname);
+			print_rx_stats(b, read_if_rx_packets(b->ifname) - b->bus_start);
+		}
+		if(drop_exit && atomic_load(&b->rx_drops)) {
+			printf("%s: %lu frames dropped\n", b->ifname, (unsigned long)atomic_load(&b->rx_drops));
+			status = 2;
+		}
+		close(b->can);
+		dispatch_free(&b->dispatch);
+	}
+	if(show_stats) print_render_stats(c);
+	free_video(c);
+  }
+  if(measure_latency) print_latency_stats();
 
-  return 0;
+  signal_db_free(&signal_db);
+  free_sdl();
+
+  return status;
 }
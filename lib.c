@@ -49,11 +49,17 @@
 #include <linux/can.h>
 #include <linux/can/error.h>
 
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
 #include "lib.h"
 
 #define CANID_DELIM '#'
 #define DATA_SEPERATOR '.'
 
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
 /* CAN DLC to real data length conversion helpers */
 
 static const unsigned char dlc2len[] = {0, 1, 2, 3, 4, 5, 6, 7,
@@ -85,18 +91,116 @@ unsigned char can_len2dlc(unsigned char len)
 	return len2dlc[len];
 }
 
+/* ASCII hex character to value, 16 for anything else */
+static const unsigned char hex2nibble[256] = {
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 16, 16, 16, 16, 16, 16,	/* '0' - '9' */
+	16, 10, 11, 12, 13, 14, 15, 16, 16, 16, 16, 16, 16, 16, 16, 16,	/* 'A' - 'F' */
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 10, 11, 12, 13, 14, 15, 16, 16, 16, 16, 16, 16, 16, 16, 16,	/* 'a' - 'f' */
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16};
+
 unsigned char asc2nibble(char c) {
 
-	if ((c >= '0') && (c <= '9'))
-		return c - '0';
+	return hex2nibble[(unsigned char)c];
+}
 
-	if ((c >= 'A') && (c <= 'F'))
-		return c - 'A' + 10;
+#ifdef __SSE2__
+/*
+ * Vector kernels: decode a run of 16 (SSE2) or 32 (AVX2) hex characters
+ * into 8 or 16 bytes.  Nothing is stored and -1 is returned if any of the
+ * characters is not a hex digit, the caller then takes the scalar path so
+ * errors and separators are handled exactly as before.
+ */
+static int hex_block16(const char *s, unsigned char *data)
+{
+	__m128i c = _mm_loadu_si128((const __m128i *)s);
+	/* '0'..'9' -> 0..9, 'A'..'F' and 'a'..'f' -> 0..5 after folding case */
+	__m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	__m128i isd = _mm_and_si128(_mm_cmpgt_epi8(d, _mm_set1_epi8(-1)), _mm_cmplt_epi8(d, _mm_set1_epi8(10)));
+	__m128i isl = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8(-1)), _mm_cmplt_epi8(l, _mm_set1_epi8(6)));
+	__m128i v, b;
+
+	if (_mm_movemask_epi8(_mm_or_si128(isd, isl)) != 0xFFFF)
+		return -1;
+
+	v = _mm_or_si128(_mm_and_si128(isd, d), _mm_and_si128(isl, _mm_add_epi8(l, _mm_set1_epi8(10))));
+	/* each 16 bit lane holds a high/low nibble pair, merge it into one byte */
+	b = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(v, 4), _mm_set1_epi16(0x00F0)), _mm_srli_epi16(v, 8));
+	_mm_storel_epi64((__m128i *)data, _mm_packus_epi16(b, b));
+	return 0;
+}
 
-	if ((c >= 'a') && (c <= 'f'))
-		return c - 'a' + 10;
+__attribute__((target("avx2")))
+static int hex_block32(const char *s, unsigned char *data)
+{
+	__m256i c = _mm256_loadu_si256((const __m256i *)s);
+	__m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+	__m256i l = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+	__m256i isd = _mm256_andnot_si256(_mm256_cmpgt_epi8(d, _mm256_set1_epi8(9)), _mm256_cmpgt_epi8(d, _mm256_set1_epi8(-1)));
+	__m256i isl = _mm256_andnot_si256(_mm256_cmpgt_epi8(l, _mm256_set1_epi8(5)), _mm256_cmpgt_epi8(l, _mm256_set1_epi8(-1)));
+	__m256i v, b;
+
+	if (_mm256_movemask_epi8(_mm256_or_si256(isd, isl)) != -1)
+		return -1;
+
+	v = _mm256_or_si256(_mm256_and_si256(isd, d), _mm256_and_si256(isl, _mm256_add_epi8(l, _mm256_set1_epi8(10))));
+	b = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(v, 4), _mm256_set1_epi16(0x00F0)), _mm256_srli_epi16(v, 8));
+	/* packus works per 128 bit lane, gather both halves into the low one */
+	b = _mm256_permute4x64_epi64(_mm256_packus_epi16(b, b), 0x08);
+	_mm_storeu_si128((__m128i *)data, _mm256_castsi256_si128(b));
+	return 0;
+}
+#endif
 
-	return 16; /* error */
+/* Kernels hex_blocks() may use, see lib_simd_level() */
+static int simd_max = LIB_SIMD_AVX2;
+
+int lib_simd_level(int max)
+{
+	simd_max = max;
+#ifdef __SSE2__
+	if (simd_max >= LIB_SIMD_AVX2 && !__builtin_cpu_supports("avx2"))
+		simd_max = LIB_SIMD_SSE2;
+#else
+	simd_max = LIB_SIMD_NONE;
+#endif
+	return simd_max;
+}
+
+/*
+ * Decodes whole blocks of hex characters from s for as long as they are
+ * valid, up to max bytes.  Returns the number of bytes written, the rest
+ * is left to the scalar code.  s must have at least 2*max readable chars.
+ */
+static int hex_blocks(const char *s, unsigned char *data, int max)
+{
+	int n = 0;
+
+#ifdef __SSE2__
+	if (simd_max >= LIB_SIMD_AVX2 && max >= 16 && __builtin_cpu_supports("avx2"))
+		while (max - n >= 16 && !hex_block32(s + 2*n, data + n))
+			n += 16;
+	if (simd_max >= LIB_SIMD_SSE2)
+		while (max - n >= 8 && !hex_block16(s + 2*n, data + n))
+			n += 8;
+#else
+	(void)s;
+	(void)data;
+	(void)max;
+#endif
+	return n;
 }
 
 int hexstring2data(char *arg, unsigned char *data, int maxdlen) {
@@ -110,7 +214,7 @@ int hexstring2data(char *arg, unsigned char *data, int maxdlen) {
 
 	memset(data, 0, maxdlen);
 
-	for (i=0; i < len/2; i++) {
+	for (i = hex_blocks(arg, data, len/2); i < len/2; i++) {
 
 		tmp = asc2nibble(*(arg+(2*i)));
 		if (tmp > 0x0F)
@@ -131,7 +235,7 @@ int hexstring2data(char *arg, unsigned char *data, int maxdlen) {
 int parse_canframe(char *cs, struct canfd_frame *cf) {
 	/* documentation see lib.h */
 
-	int i, idx, dlen, len;
+	int i, idx, dlen, len, n;
 	int maxdlen = CAN_MAX_DLEN;
 	int ret = CAN_MTU;
 	unsigned char tmp;
@@ -198,6 +302,15 @@ int parse_canframe(char *cs, struct canfd_frame *cf) {
 		if(idx >= len) /* end of string => end of data */
 			break;
 
+		/* fast path for runs of hex digits without separators */
+		n = hex_blocks(&cs[idx], &cf->data[i], MIN((len - idx)/2, maxdlen - i));
+		if (n) {
+			idx += 2*n;
+			dlen += n;
+			i += n - 1;
+			continue;
+		}
+
 		if ((tmp = asc2nibble(cs[idx++])) > 0x0F)
 			return 0;
 		cf->data[i] = (tmp << 4);
@@ -211,141 +324,312 @@ int parse_canframe(char *cs, struct canfd_frame *cf) {
 	return ret;
 }
 
+/*
+ * Scalar reference versions, kept to check the fast paths against
+ */
+
+static unsigned char asc2nibble_ref(char c) {
+
+	if ((c >= '0') && (c <= '9'))
+		return c - '0';
+
+	if ((c >= 'A') && (c <= 'F'))
+		return c - 'A' + 10;
+
+	if ((c >= 'a') && (c <= 'f'))
+		return c - 'a' + 10;
+
+	return 16; /* error */
+}
+
+int hexstring2data_ref(char *arg, unsigned char *data, int maxdlen) {
+
+	int len = strlen(arg);
+	int i;
+	unsigned char tmp;
+
+	if (!len || len%2 || len > maxdlen*2)
+		return 1;
+
+	memset(data, 0, maxdlen);
+
+	for (i=0; i < len/2; i++) {
+
+		tmp = asc2nibble_ref(*(arg+(2*i)));
+		if (tmp > 0x0F)
+			return 1;
+
+		data[i] = (tmp << 4);
+
+		tmp = asc2nibble_ref(*(arg+(2*i)+1));
+		if (tmp > 0x0F)
+			return 1;
+
+		data[i] |= tmp;
+	}
+
+	return 0;
+}
+
+int parse_canframe_ref(char *cs, struct canfd_frame *cf) {
+	/* documentation see lib.h */
+
+	int i, idx, dlen, len;
+	int maxdlen = CAN_MAX_DLEN;
+	int ret = CAN_MTU;
+	unsigned char tmp;
+
+	len = strlen(cs);
+	//printf("'%s' len %d\n", cs, len);
+
+	memset(cf, 0, sizeof(*cf)); /* init CAN FD frame, e.g. LEN = 0 */
+
+	if (len < 4)
+		return 0;
+
+	if (cs[3] == CANID_DELIM) { /* 3 digits */
+
+		idx = 4;
+		for (i=0; i<3; i++){
+			if ((tmp = asc2nibble_ref(cs[i])) > 0x0F)
+				return 0;
+			cf->can_id |= (tmp << (2-i)*4);
+		}
+
+	} else if (cs[8] == CANID_DELIM) { /* 8 digits */
+
+		idx = 9;
+		for (i=0; i<8; i++){
+			if ((tmp = asc2nibble_ref(cs[i])) > 0x0F)
+				return 0;
+			cf->can_id |= (tmp << (7-i)*4);
+		}
+		if (!(cf->can_id & CAN_ERR_FLAG)) /* 8 digits but no errorframe?  */
+			cf->can_id |= CAN_EFF_FLAG;   /* then it is an extended frame */
+
+	} else
+		return 0;
+
+	if((cs[idx] == 'R') || (cs[idx] == 'r')){ /* RTR frame */
+		cf->can_id |= CAN_RTR_FLAG;
+
+		/* check for optional DLC value for CAN 2.0B frames */
+		if(cs[++idx] && (tmp = asc2nibble_ref(cs[idx])) <= CAN_MAX_DLC)
+			cf->len = tmp;
+
+		return ret;
+	}
+
+	if (cs[idx] == CANID_DELIM) { /* CAN FD frame escape char '##' */
+
+		maxdlen = CANFD_MAX_DLEN;
+		ret = CANFD_MTU;
+
+		/* CAN FD frame <canid>##<flags><data>* */
+		if ((tmp = asc2nibble_ref(cs[idx+1])) > 0x0F)
+			return 0;
+
+		cf->flags = tmp;
+		idx += 2;
+	}
+
+	for (i=0, dlen=0; i < maxdlen; i++){
+
+		if(cs[idx] == DATA_SEPERATOR) /* skip (optional) separator */
+			idx++;
+
+		if(idx >= len) /* end of string => end of data */
+			break;
+
+		if ((tmp = asc2nibble_ref(cs[idx++])) > 0x0F)
+			return 0;
+		cf->data[i] = (tmp << 4);
+		if ((tmp = asc2nibble_ref(cs[idx++])) > 0x0F)
+			return 0;
+		cf->data[i] |= tmp;
+		dlen++;
+	}
+	cf->len = dlen;
+
+	return ret;
+}
+
+/* Two ASCII hex digits per byte value */
+static const char hexbyte[] =
+	"000102030405060708090A0B0C0D0E0F"
+	"101112131415161718191A1B1C1D1E1F"
+	"202122232425262728292A2B2C2D2E2F"
+	"303132333435363738393A3B3C3D3E3F"
+	"404142434445464748494A4B4C4D4E4F"
+	"505152535455565758595A5B5C5D5E5F"
+	"606162636465666768696A6B6C6D6E6F"
+	"707172737475767778797A7B7C7D7E7F"
+	"808182838485868788898A8B8C8D8E8F"
+	"909192939495969798999A9B9C9D9E9F"
+	"A0A1A2A3A4A5A6A7A8A9AAABACADAEAF"
+	"B0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+	"C0C1C2C3C4C5C6C7C8C9CACBCCCDCECF"
+	"D0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+	"E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEF"
+	"F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+static const char hexdigit[] = "0123456789ABCDEF";
+
+/* Four ASCII binary digits per nibble value */
+static const char binnibble[16][5] = {
+	"0000", "0001", "0010", "0011",
+	"0100", "0101", "0110", "0111",
+	"1000", "1001", "1010", "1011",
+	"1100", "1101", "1110", "1111"};
+
+static inline char *put_hex(char *p, canid_t v, int digits)
+{
+	int i;
+
+	for (i = digits - 1; i >= 0; i--)
+		*p++ = hexdigit[(v >> (4*i)) & 0xF];
+	return p;
+}
+
+static inline char *put_byte(char *p, unsigned char b)
+{
+	memcpy(p, &hexbyte[2*b], 2);
+	return p + 2;
+}
+
+static inline char *put_spaces(char *p, int n)
+{
+	memset(p, ' ', n);
+	return p + n;
+}
+
 void fprint_canframe(FILE *stream , struct canfd_frame *cf, char *eol, int sep, int maxdlen) {
 	/* documentation see lib.h */
 
 	char buf[CL_CFSZ]; /* max length */
+	int len;
 
-	sprint_canframe(buf, cf, sep, maxdlen);
-	fprintf(stream, "%s", buf);
+	len = sprint_canframe(buf, cf, sep, maxdlen);
+	/* keep the line together when several threads print */
+	flockfile(stream);
+	fwrite(buf, 1, len, stream);
 	if (eol)
-		fprintf(stream, "%s", eol);
+		fputs(eol, stream);
+	funlockfile(stream);
 }
 
-void sprint_canframe(char *buf , struct canfd_frame *cf, int sep, int maxdlen) {
+int sprint_canframe(char *buf , struct canfd_frame *cf, int sep, int maxdlen) {
 	/* documentation see lib.h */
 
-	int i,offset;
+	char *p = buf;
+	int i;
 	int len = (cf->len > maxdlen) ? maxdlen : cf->len;
 
-	if (cf->can_id & CAN_ERR_FLAG) {
-		sprintf(buf, "%08X#", cf->can_id & (CAN_ERR_MASK|CAN_ERR_FLAG));
-		offset = 9;
-	} else if (cf->can_id & CAN_EFF_FLAG) {
-		sprintf(buf, "%08X#", cf->can_id & CAN_EFF_MASK);
-		offset = 9;
-	} else {
-		sprintf(buf, "%03X#", cf->can_id & CAN_SFF_MASK);
-		offset = 4;
-	}
+	if (cf->can_id & CAN_ERR_FLAG)
+		p = put_hex(p, cf->can_id & (CAN_ERR_MASK|CAN_ERR_FLAG), 8);
+	else if (cf->can_id & CAN_EFF_FLAG)
+		p = put_hex(p, cf->can_id & CAN_EFF_MASK, 8);
+	else
+		p = put_hex(p, cf->can_id & CAN_SFF_MASK, 3);
+	*p++ = CANID_DELIM;
 
 	/* standard CAN frames may have RTR enabled. There are no ERR frames with RTR */
 	if (maxdlen == CAN_MAX_DLEN && cf->can_id & CAN_RTR_FLAG) {
 
+		*p++ = 'R';
 		/* print a given CAN 2.0B DLC if it's not zero */
 		if (cf->len && cf->len <= CAN_MAX_DLC)
-			sprintf(buf+offset, "R%d", cf->len);
-		else
-			sprintf(buf+offset, "R");
-
-		return;
+			*p++ = '0' + cf->len;
+		*p = 0;
+		return p - buf;
 	}
 
 	if (maxdlen == CANFD_MAX_DLEN) {
 		/* add CAN FD specific escape char and flags */
-		sprintf(buf+offset, "#%X", cf->flags & 0xF);
-		offset += 2;
+		*p++ = CANID_DELIM;
+		*p++ = hexdigit[cf->flags & 0xF];
 		if (sep && len)
-			sprintf(buf+offset++, ".");
+			*p++ = DATA_SEPERATOR;
 	}
 
 	for (i = 0; i < len; i++) {
-		sprintf(buf+offset, "%02X", cf->data[i]);
-		offset += 2;
+		p = put_byte(p, cf->data[i]);
 		if (sep && (i+1 < len))
-			sprintf(buf+offset++, ".");
+			*p++ = DATA_SEPERATOR;
 	}
+	*p = 0;
+
+	return p - buf;
 }
 
 void fprint_long_canframe(FILE *stream , struct canfd_frame *cf, char *eol, int view, int maxdlen) {
 	/* documentation see lib.h */
 
 	char buf[CL_LONGCFSZ];
+	int len;
 
-	sprint_long_canframe(buf, cf, view, maxdlen);
-	fprintf(stream, "%s", buf);
+	len = sprint_long_canframe(buf, cf, view, maxdlen);
+	flockfile(stream);
+	fwrite(buf, 1, len, stream);
 	if ((view & CANLIB_VIEW_ERROR) && (cf->can_id & CAN_ERR_FLAG)) {
 		snprintf_can_error_frame(buf, sizeof(buf), cf, "\n\t");
-		fprintf(stream, "\n\t%s", buf);
+		fputs("\n\t", stream);
+		fputs(buf, stream);
 	}
 	if (eol)
-		fprintf(stream, "%s", eol);
+		fputs(eol, stream);
+	funlockfile(stream);
 }
 
-void sprint_long_canframe(char *buf , struct canfd_frame *cf, int view, int maxdlen) {
+int sprint_long_canframe(char *buf , struct canfd_frame *cf, int view, int maxdlen) {
 	/* documentation see lib.h */
 
-	int i, j, dlen, offset;
+	char *p = buf;
+	int i, dlen;
 	int len = (cf->len > maxdlen)? maxdlen : cf->len;
 
 	if (cf->can_id & CAN_ERR_FLAG) {
-		sprintf(buf, "%08X  ", cf->can_id & (CAN_ERR_MASK|CAN_ERR_FLAG));
-		offset = 10;
+		p = put_hex(p, cf->can_id & (CAN_ERR_MASK|CAN_ERR_FLAG), 8);
 	} else if (cf->can_id & CAN_EFF_FLAG) {
-		sprintf(buf, "%08X  ", cf->can_id & CAN_EFF_MASK);
-		offset = 10;
+		p = put_hex(p, cf->can_id & CAN_EFF_MASK, 8);
 	} else {
-		if (view & CANLIB_VIEW_INDENT_SFF) {
-			sprintf(buf, "     %03X  ", cf->can_id & CAN_SFF_MASK);
-			offset = 10;
-		} else {
-			sprintf(buf, "%03X  ", cf->can_id & CAN_SFF_MASK);
-			offset = 5;
-		}
+		if (view & CANLIB_VIEW_INDENT_SFF)
+			p = put_spaces(p, 5);
+		p = put_hex(p, cf->can_id & CAN_SFF_MASK, 3);
 	}
+	p = put_spaces(p, 2);
 
 	if (maxdlen == CAN_MAX_DLEN) {
-		sprintf(buf+offset, " [%d] ", len);
+		memcpy(p, " [0] ", 5);
+		p[2] = '0' + len;
+		p += 5;
 		/* standard CAN frames may have RTR enabled */
 		if (cf->can_id & CAN_RTR_FLAG) {
-			sprintf(buf+offset+5, " remote request");
-			return;
+			memcpy(p, " remote request", sizeof(" remote request"));
+			return p - buf + sizeof(" remote request") - 1;
 		}
 	} else {
-		sprintf(buf+offset, "[%02d] ", len);
+		memcpy(p, "[00] ", 5);
+		p[1] = '0' + len / 10;
+		p[2] = '0' + len % 10;
+		p += 5;
 	}
-	offset += 5;
 
 	if (view & CANLIB_VIEW_BINARY) {
 		dlen = 9; /* _10101010 */
-		if (view & CANLIB_VIEW_SWAP) {
-			for (i = len - 1; i >= 0; i--) {
-				buf[offset++] = (i == len-1)?' ':SWAP_DELIMITER;
-				for (j = 7; j >= 0; j--)
-					buf[offset++] = (1<<j & cf->data[i])?'1':'0';
-			}
-		} else {
-			for (i = 0; i < len; i++) {
-				buf[offset++] = ' ';
-				for (j = 7; j >= 0; j--)
-					buf[offset++] = (1<<j & cf->data[i])?'1':'0';
-			}
+		for (i = 0; i < len; i++) {
+			unsigned char b = cf->data[(view & CANLIB_VIEW_SWAP) ? len - 1 - i : i];
+
+			*p++ = (i && (view & CANLIB_VIEW_SWAP)) ? SWAP_DELIMITER : ' ';
+			memcpy(p, binnibble[b >> 4], 4);
+			memcpy(p + 4, binnibble[b & 0xF], 4);
+			p += 8;
 		}
-		buf[offset] = 0; /* terminate string */
 	} else {
 		dlen = 3; /* _AA */
-		if (view & CANLIB_VIEW_SWAP) {
-			for (i = len - 1; i >= 0; i--) {
-				sprintf(buf+offset, "%c%02X",
-					(i == len-1)?' ':SWAP_DELIMITER,
-					cf->data[i]);
-				offset += dlen;
-			}
-		} else {
-			for (i = 0; i < len; i++) {
-				sprintf(buf+offset, " %02X", cf->data[i]);
-				offset += dlen;
-			}
+		for (i = 0; i < len; i++) {
+			*p++ = (i && (view & CANLIB_VIEW_SWAP)) ? SWAP_DELIMITER : ' ';
+			p = put_byte(p, cf->data[(view & CANLIB_VIEW_SWAP) ? len - 1 - i : i]);
 		}
 	}
 
@@ -354,35 +638,27 @@ void sprint_long_canframe(char *buf , struct canfd_frame *cf, int view, int maxd
 	 * For now we support ASCII output only for payload length up to 8 bytes.
 	 * Does it make sense to write 64 ASCII byte behind 64 ASCII HEX data on the console?
 	 */
-	if (len > CAN_MAX_DLEN)
-		return;
-
-	if (cf->can_id & CAN_ERR_FLAG)
-		sprintf(buf+offset, "%*s", dlen*(8-len)+13, "ERRORFRAME");
-	else if (view & CANLIB_VIEW_ASCII) {
-		j = dlen*(8-len)+4;
-		if (view & CANLIB_VIEW_SWAP) {
-			sprintf(buf+offset, "%*s", j, "`");
-			offset += j;
-			for (i = len - 1; i >= 0; i--)
-				if ((cf->data[i] > 0x1F) && (cf->data[i] < 0x7F))
-					buf[offset++] = cf->data[i];
-				else
-					buf[offset++] = '.';
-
-			sprintf(buf+offset, "`");
-		} else {
-			sprintf(buf+offset, "%*s", j, "'");
-			offset += j;
-			for (i = 0; i < len; i++)
-				if ((cf->data[i] > 0x1F) && (cf->data[i] < 0x7F))
-					buf[offset++] = cf->data[i];
-				else
-					buf[offset++] = '.';
+	if (len <= CAN_MAX_DLEN) {
+		if (cf->can_id & CAN_ERR_FLAG) {
+			p = put_spaces(p, dlen*(8-len)+3);
+			memcpy(p, "ERRORFRAME", 10);
+			p += 10;
+		} else if (view & CANLIB_VIEW_ASCII) {
+			char quote = (view & CANLIB_VIEW_SWAP) ? '`' : '\'';
+
+			p = put_spaces(p, dlen*(8-len)+3);
+			*p++ = quote;
+			for (i = 0; i < len; i++) {
+				unsigned char b = cf->data[(view & CANLIB_VIEW_SWAP) ? len - 1 - i : i];
 
-			sprintf(buf+offset, "'");
+				*p++ = ((b > 0x1F) && (b < 0x7F)) ? b : '.';
+			}
+			*p++ = quote;
 		}
 	}
+	*p = 0;
+
+	return p - buf;
 }
 
 static const char *error_classes[] = {
@@ -562,3 +838,151 @@ void snprintf_can_error_frame(char *buf, size_t len, struct canfd_frame *cf,
 			      cf->data[6], cf->data[7]);
 	}
 }
+
+void sprint_canframe_ref(char *buf , struct canfd_frame *cf, int sep, int maxdlen) {
+	/* documentation see lib.h */
+
+	int i,offset;
+	int len = (cf->len > maxdlen) ? maxdlen : cf->len;
+
+	if (cf->can_id & CAN_ERR_FLAG) {
+		sprintf(buf, "%08X#", cf->can_id & (CAN_ERR_MASK|CAN_ERR_FLAG));
+		offset = 9;
+	} else if (cf->can_id & CAN_EFF_FLAG) {
+		sprintf(buf, "%08X#", cf->can_id & CAN_EFF_MASK);
+		offset = 9;
+	} else {
+		sprintf(buf, "%03X#", cf->can_id & CAN_SFF_MASK);
+		offset = 4;
+	}
+
+	/* standard CAN frames may have RTR enabled. There are no ERR frames with RTR */
+	if (maxdlen == CAN_MAX_DLEN && cf->can_id & CAN_RTR_FLAG) {
+
+		/* print a given CAN 2.0B DLC if it's not zero */
+		if (cf->len && cf->len <= CAN_MAX_DLC)
+			sprintf(buf+offset, "R%d", cf->len);
+		else
+			sprintf(buf+offset, "R");
+
+		return;
+	}
+
+	if (maxdlen == CANFD_MAX_DLEN) {
+		/* add CAN FD specific escape char and flags */
+		sprintf(buf+offset, "#%X", cf->flags & 0xF);
+		offset += 2;
+		if (sep && len)
+			sprintf(buf+offset++, ".");
+	}
+
+	for (i = 0; i < len; i++) {
+		sprintf(buf+offset, "%02X", cf->data[i]);
+		offset += 2;
+		if (sep && (i+1 < len))
+			sprintf(buf+offset++, ".");
+	}
+}
+
+void sprint_long_canframe_ref(char *buf , struct canfd_frame *cf, int view, int maxdlen) {
+	/* documentation see lib.h */
+
+	int i, j, dlen, offset;
+	int len = (cf->len > maxdlen)? maxdlen : cf->len;
+
+	if (cf->can_id & CAN_ERR_FLAG) {
+		sprintf(buf, "%08X  ", cf->can_id & (CAN_ERR_MASK|CAN_ERR_FLAG));
+		offset = 10;
+	} else if (cf->can_id & CAN_EFF_FLAG) {
+		sprintf(buf, "%08X  ", cf->can_id & CAN_EFF_MASK);
+		offset = 10;
+	} else {
+		if (view & CANLIB_VIEW_INDENT_SFF) {
+			sprintf(buf, "     %03X  ", cf->can_id & CAN_SFF_MASK);
+			offset = 10;
+		} else {
+			sprintf(buf, "%03X  ", cf->can_id & CAN_SFF_MASK);
+			offset = 5;
+		}
+	}
+
+	if (maxdlen == CAN_MAX_DLEN) {
+		sprintf(buf+offset, " [%d] ", len);
+		/* standard CAN frames may have RTR enabled */
+		if (cf->can_id & CAN_RTR_FLAG) {
+			sprintf(buf+offset+5, " remote request");
+			return;
+		}
+	} else {
+		sprintf(buf+offset, "[%02d] ", len);
+	}
+	offset += 5;
+
+	if (view & CANLIB_VIEW_BINARY) {
+		dlen = 9; /* _10101010 */
+		if (view & CANLIB_VIEW_SWAP) {
+			for (i = len - 1; i >= 0; i--) {
+				buf[offset++] = (i == len-1)?' ':SWAP_DELIMITER;
+				for (j = 7; j >= 0; j--)
+					buf[offset++] = (1<<j & cf->data[i])?'1':'0';
+			}
+		} else {
+			for (i = 0; i < len; i++) {
+				buf[offset++] = ' ';
+				for (j = 7; j >= 0; j--)
+					buf[offset++] = (1<<j & cf->data[i])?'1':'0';
+			}
+		}
+		buf[offset] = 0; /* terminate string */
+	} else {
+		dlen = 3; /* _AA */
+		if (view & CANLIB_VIEW_SWAP) {
+			for (i = len - 1; i >= 0; i--) {
+				sprintf(buf+offset, "%c%02X",
+					(i == len-1)?' ':SWAP_DELIMITER,
+					cf->data[i]);
+				offset += dlen;
+			}
+		} else {
+			for (i = 0; i < len; i++) {
+				sprintf(buf+offset, " %02X", cf->data[i]);
+				offset += dlen;
+			}
+		}
+	}
+
+	/*
+	 * The ASCII & ERRORFRAME output is put at a fixed len behind the data.
+	 * For now we support ASCII output only for payload length up to 8 bytes.
+	 * Does it make sense to write 64 ASCII byte behind 64 ASCII HEX data on the console?
+	 */
+	if (len > CAN_MAX_DLEN)
+		return;
+
+	if (cf->can_id & CAN_ERR_FLAG)
+		sprintf(buf+offset, "%*s", dlen*(8-len)+13, "ERRORFRAME");
+	else if (view & CANLIB_VIEW_ASCII) {
+		j = dlen*(8-len)+4;
+		if (view & CANLIB_VIEW_SWAP) {
+			sprintf(buf+offset, "%*s", j, "`");
+			offset += j;
+			for (i = len - 1; i >= 0; i--)
+				if ((cf->data[i] > 0x1F) && (cf->data[i] < 0x7F))
+					buf[offset++] = cf->data[i];
+				else
+					buf[offset++] = '.';
+
+			sprintf(buf+offset, "`");
+		} else {
+			sprintf(buf+offset, "%*s", j, "'");
+			offset += j;
+			for (i = 0; i < len; i++)
+				if ((cf->data[i] > 0x1F) && (cf->data[i] < 0x7F))
+					buf[offset++] = cf->data[i];
+				else
+					buf[offset++] = '.';
+
+			sprintf(buf+offset, "'");
+		}
+	}
+}
@@ -143,7 +143,7 @@ int parse_canframe(char *cs, struct canfd_frame *cf);
  */
 
 void fprint_canframe(FILE *stream , struct canfd_frame *cf, char *eol, int sep, int maxdlen);
-void sprint_canframe(char *buf , struct canfd_frame *cf, int sep, int maxdlen);
+int sprint_canframe(char *buf , struct canfd_frame *cf, int sep, int maxdlen);
 /*
  * Creates a CAN frame hexadecimal output in compact format.
  * The CAN data[] is separated by '.' when sep != 0.
@@ -165,6 +165,9 @@ void sprint_canframe(char *buf , struct canfd_frame *cf, int sep, int maxdlen);
  * fprint_canframe(stdout, &frame, "\n", 0); // with eol to STDOUT
  * fprint_canframe(stderr, &frame, NULL, 0); // no eol to STDERR
  *
+ * sprint_canframe() returns the length of the string written to buf, buf
+ * needs CL_CFSZ bytes.
+ *
  */
 
 #define CANLIB_VIEW_ASCII	0x1
@@ -176,7 +179,7 @@ void sprint_canframe(char *buf , struct canfd_frame *cf, int sep, int maxdlen);
 #define SWAP_DELIMITER '`'
 
 void fprint_long_canframe(FILE *stream , struct canfd_frame *cf, char *eol, int view, int maxdlen);
-void sprint_long_canframe(char *buf , struct canfd_frame *cf, int view, int maxdlen);
+int sprint_long_canframe(char *buf , struct canfd_frame *cf, int view, int maxdlen);
 /*
  * Creates a CAN frame hexadecimal output in user readable format.
  *
@@ -201,6 +204,9 @@ void sprint_long_canframe(char *buf , struct canfd_frame *cf, int view, int maxd
  * // CAN 2.0 frame without eol to STDERR
  * fprint_long_canframe(stderr, &frame, NULL, 0, CAN_MAX_DLEN);
  *
+ * sprint_long_canframe() returns the length of the string written to buf,
+ * buf needs CL_LONGCFSZ bytes.
+ *
  */
 
 void snprintf_can_error_frame(char *buf, size_t len, struct canfd_frame *cf,
@@ -208,3 +214,25 @@ void snprintf_can_error_frame(char *buf, size_t len, struct canfd_frame *cf,
 /*
  * Creates a CAN error frame output in user readable format.
  */
+
+#define LIB_SIMD_NONE 0
+#define LIB_SIMD_SSE2 1
+#define LIB_SIMD_AVX2 2
+
+int lib_simd_level(int max);
+/*
+ * Caps the vector kernels hexstring2data() and parse_canframe() use at
+ * max, by default they use the best one the CPU has.  Returns the level
+ * in effect, lower than max if the build or the CPU can't do it.  Meant
+ * for differential tests and benchmarks, not thread safe.
+ */
+
+int hexstring2data_ref(char *arg, unsigned char *data, int maxdlen);
+int parse_canframe_ref(char *cs, struct canfd_frame *cf);
+void sprint_canframe_ref(char *buf , struct canfd_frame *cf, int sep, int maxdlen);
+void sprint_long_canframe_ref(char *buf , struct canfd_frame *cf, int view, int maxdlen);
+/*
+ * The original scalar and sprintf() based versions of the parsers and
+ * formatters above, kept as the reference results to check the fast ones
+ * against.
+ */
@@ -0,0 +1,195 @@
+/*
+ * CAN log replay engine
+ */
+
+#define _GNU_SOURCE // sendmmsg()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
+#include <net/if.h>
+#include <linux/can/raw.h>
+
+#include "replay.h"
+#include "timeutil.h"
+
+#define REPLAY_BURST 64 // Max frames per sendmmsg()
+#define REPLAY_SPIN_NS 100000 // Sleep until this close to a frame, then spin
+#define REPLAY_RETRY_NS 100000 // Back off when the TX queue is full
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+int replay_load(struct replay *r, char *fname) {
+  memset(r, 0, sizeof(*r));
+  r->sock = r->stop_fd = r->timer_fd = -1;
+  r->rate = 1;
+  hist_init(&r->late);
+  return cap_open(&r->cap, fname);
+}
+
+/* Waits for target, returns -1 if asked to stop meanwhile */
+static int wait_precise(struct replay *r, uint64_t target) {
+  if(target > mono_ns() + REPLAY_SPIN_NS &&
+     wait_until(r->timer_fd, r->stop_fd, target - REPLAY_SPIN_NS) < 0)
+    return -1;
+  // The timer is only good to about its slack, spin the rest of the way
+  while(mono_ns() < target)
+    cpu_relax();
+  return atomic_load_explicit(&r->stop, memory_order_relaxed) ? -1 : 0;
+}
+
+static void send_burst(struct replay *r, struct mmsghdr *msgs, int n) {
+  struct timespec backoff = { 0, REPLAY_RETRY_NS };
+  int sent;
+
+  while(n > 0 && !atomic_load_explicit(&r->stop, memory_order_relaxed)) {
+    sent = sendmmsg(r->sock, msgs, n, MSG_DONTWAIT);
+    if(sent < 0) {
+      if(errno == ENOBUFS || errno == EAGAIN) {
+        nanosleep(&backoff, NULL);
+        continue;
+      }
+      if(errno == EINTR) continue;
+      r->errors++;
+      perror("replay sendmmsg");
+      return;
+    }
+    r->sent += sent;
+    msgs += sent;
+    n -= sent;
+  }
+}
+
+static void *replay_thread(void *arg) {
+  struct replay *r = arg;
+  struct mmsghdr msgs[REPLAY_BURST];
+  struct iovec iovs[REPLAY_BURST];
+  struct cap_record *rec = r->cap.records;
+  uint64_t count = r->cap.count, base = rec[0].ts_ns;
+  double scale = r->rate > 0 ? 1 / r->rate : 0;
+  uint64_t pass, t0, start, target, now, i = 0;
+  int n;
+
+  // Default timer slack is 50us, well above what we are after
+  prctl(PR_SET_TIMERSLACK, 1UL);
+  pass = (rec[count - 1].ts_ns - base) * scale;
+  // Passes are spaced like the average frame so the bus doesn't go quiet
+  if(count > 1) pass += pass / (count - 1);
+  memset(msgs, 0, sizeof(msgs));
+  t0 = start = mono_ns();
+  while(1) {
+    if(i == count) {
+      r->loops++;
+      if(r->loops == (unsigned long)r->loop) break;
+      start += pass;
+      i = 0;
+    }
+    target = start + (uint64_t)((rec[i].ts_ns - base) * scale);
+    if(wait_precise(r, target) < 0) break;
+    now = mono_ns();
+    // Everything that is due by now goes out in one call
+    for(n = 0; n < REPLAY_BURST && i < count; n++, i++) {
+      target = start + (uint64_t)((rec[i].ts_ns - base) * scale);
+      if(target > now) break;
+      if(r->rate > 0) hist_record(&r->late, now - target);
+      iovs[n].iov_base = &rec[i].cf;
+      iovs[n].iov_len = cap_mtu(&rec[i]);
+      msgs[n].msg_hdr.msg_iov = &iovs[n];
+      msgs[n].msg_hdr.msg_iovlen = 1;
+    }
+    send_burst(r, msgs, n);
+    r->bursts++;
+  }
+  r->requested_ns = (start - t0) + (i ? (uint64_t)((rec[i - 1].ts_ns - base) * scale) : 0);
+  r->elapsed_ns = mono_ns() - t0;
+  return NULL;
+}
+
+int replay_start(struct replay *r, char *ifname) {
+  struct sockaddr_can addr;
+  struct ifreq ifr;
+  int enable_canfd = 1;
+
+  r->sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if(r->sock < 0) {
+    perror("replay socket");
+    return -1;
+  }
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+  if(ioctl(r->sock, SIOCGIFINDEX, &ifr) < 0) {
+    perror("replay SIOCGIFINDEX");
+    goto error;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  setsockopt(r->sock, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable_canfd, sizeof(enable_canfd));
+  // We only send on this socket
+  setsockopt(r->sock, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0);
+  if(bind(r->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("replay bind");
+    goto error;
+  }
+  r->stop_fd = eventfd(0, EFD_CLOEXEC);
+  r->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if(r->stop_fd < 0 || r->timer_fd < 0) {
+    perror("replay eventfd/timerfd");
+    goto error;
+  }
+  atomic_store(&r->stop, 0);
+  if(pthread_create(&r->tid, NULL, replay_thread, r) != 0) {
+    printf("Could not start the replay thread\n");
+    goto error;
+  }
+  return 0;
+
+error:
+  close(r->sock);
+  if(r->stop_fd >= 0) close(r->stop_fd);
+  if(r->timer_fd >= 0) close(r->timer_fd);
+  r->sock = r->stop_fd = r->timer_fd = -1;
+  return -1;
+}
+
+void replay_stop(struct replay *r) {
+  uint64_t one = 1;
+
+  if(r->stop_fd < 0) return;
+  atomic_store(&r->stop, 1);
+  if(write(r->stop_fd, &one, sizeof(one)) != sizeof(one)) perror("replay stop");
+  pthread_join(r->tid, NULL);
+  close(r->sock);
+  close(r->stop_fd);
+  close(r->timer_fd);
+  r->sock = r->stop_fd = r->timer_fd = -1;
+}
+
+void replay_print_stats(struct replay *r) {
+  printf("Replay: %lu frames in %lu bursts, %lu passes, %lu errors\n", r->sent, r->bursts, r->loops, r->errors);
+  if(r->rate > 0)
+    printf("Replay time: requested %.3fs achieved %.3fs at %gx\n", r->requested_ns / 1e9, r->elapsed_ns / 1e9, r->rate);
+  else
+    printf("Replay time: %.3fs as fast as possible\n", r->elapsed_ns / 1e9);
+  if(r->elapsed_ns)
+    printf("Replay rate: %.0f frames/s\n", r->sent / (r->elapsed_ns / 1e9));
+  if(r->rate > 0)
+    printf("Replay lateness (us): p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+           hist_percentile(&r->late, 50) / 1000.0, hist_percentile(&r->late, 99) / 1000.0,
+           hist_percentile(&r->late, 99.9) / 1000.0, atomic_load(&r->late.max) / 1000.0);
+}
+
+void replay_free(struct replay *r) {
+  cap_close(&r->cap);
+}
@@ -0,0 +1,71 @@
+/*
+ * CAN log replay engine
+ *
+ * Plays candump log files (as written by candump -l) onto a CAN interface
+ * from a background thread, scheduled from the log timestamps.  Frames
+ * are sent on time by sleeping until just before they are due and spinning
+ * the rest of the way, frames due together go out in one sendmmsg() call.
+ */
+
+#ifndef ICSIM_REPLAY_H
+#define ICSIM_REPLAY_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <linux/can.h>
+
+#include "histogram.h"
+#include "capture.h"
+
+struct replay {
+  struct cap_file cap; // Frames are sent straight from here
+  int loop; // Passes over the log, 0 = forever
+  double rate; // Speed multiplier, 1 = real time, 0 = as fast as possible
+  int sock;
+  int stop_fd; // eventfd, wakes the thread up to stop
+  int timer_fd;
+  atomic_int stop;
+  pthread_t tid;
+  // Statistics, only valid once the thread is stopped
+  unsigned long sent;
+  unsigned long bursts;
+  unsigned long errors;
+  unsigned long loops;
+  uint64_t requested_ns; // Time the log asked for at the replay rate
+  uint64_t elapsed_ns; // Time it took
+  struct histogram late; // Send time - scheduled time
+};
+
+int replay_load(struct replay *r, char *fname);
+/*
+ * Opens a binary capture (mapped, frames are sent without copying) or a
+ * candump log file, lines look like:
+ *
+ * (1398128223.803317) can0 166#D0320009
+ *
+ * The interface name is ignored, all frames go out on the replay
+ * interface.  Returns 0 on success, -1 if the file can't be read or has
+ * no frames.
+ */
+
+int replay_start(struct replay *r, char *ifname);
+/*
+ * Opens a socket on ifname and starts playing the loaded frames at
+ * r->rate, r->loop times.  Each pass starts where the previous one ended,
+ * one average frame gap after its last frame, so looping doesn't leave
+ * a hole or burst in the traffic.
+ * Returns 0 on success, -1 on error.
+ */
+
+void replay_stop(struct replay *r);
+/*
+ * Stops the replay thread and waits for it, safe to call if the replay
+ * was never started.
+ */
+
+void replay_print_stats(struct replay *r);
+
+void replay_free(struct replay *r);
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ * Signal database
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "signals.h"
+
+const char *signal_names[NUM_SIGNALS] = { "speed", "signal", "door" };
+
+static int parse_def(char *line, struct signal_def *def) {
+  char endian[4];
+  long id;
+  int n;
+
+  memset(def, 0, sizeof(*def));
+  n = sscanf(line, "%31s %31s %li %d %d %d %3s %lf %lf", def->model, def->name,
+             &id, &def->byte, &def->bit, &def->bits, endian, &def->scale, &def->offset);
+  if(n != 9 || id < 0) return -1;
+  if(!strcasecmp(endian, "be")) def->big_endian = 1;
+  else if(strcasecmp(endian, "le")) return -1;
+  if(id & CAN_EFF_FLAG || id > CAN_SFF_MASK) id = (id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+  def->id = id;
+  if(!def->scale) return -1;
+  if(def->bit < 0 || def->bits < 1 || def->bit + def->bits > 32) return -1;
+  // Only the bytes the signal covers have to fit in a frame
+  if(def->byte < 0 || def->byte + (def->bit + def->bits + 7) / 8 > CANFD_MAX_DLEN) return -1;
+  return 0;
+}
+
+int signal_db_load(struct signal_db *db, char *fname) {
+  struct signal_def def, *defs;
+  char line[256], *p;
+  int lineno = 0;
+  FILE *fp;
+
+  db->defs = NULL;
+  db->count = 0;
+  fp = fopen(fname, "r");
+  if(!fp) {
+    perror(fname);
+    return -1;
+  }
+  while(fgets(line, sizeof(line), fp)) {
+    lineno++;
+    for(p = line; *p == ' ' || *p == '\t'; p++);
+    if(*p == '#' || *p == '\n' || *p == '\r' || *p == 0) continue;
+    if(parse_def(p, &def) < 0) {
+      fprintf(stderr, "%s:%d: bad signal definition\n", fname, lineno);
+      goto error;
+    }
+    defs = realloc(db->defs, (db->count + 1) * sizeof(*defs));
+    if(!defs) {
+      fprintf(stderr, "%s: out of memory\n", fname);
+      goto error;
+    }
+    db->defs = defs;
+    db->defs[db->count++] = def;
+  }
+  fclose(fp);
+  return 0;
+
+error:
+  fclose(fp);
+  signal_db_free(db);
+  return -1;
+}
+
+void signal_db_free(struct signal_db *db) {
+  free(db->defs);
+  db->defs = NULL;
+  db->count = 0;
+}
+
+int signal_db_has_model(struct signal_db *db, char *model) {
+  int i;
+
+  for(i = 0; i < db->count; i++)
+    if(!strcmp(db->defs[i].model, model)) return 1;
+  return 0;
+}
+
+void signal_db_print_models(struct signal_db *db) {
+  int i, j;
+
+  printf("Acceptable models:");
+  for(i = 0; i < db->count; i++) {
+    // First definition of each model only
+    for(j = 0; j < i; j++)
+      if(!strcmp(db->defs[j].model, db->defs[i].model)) break;
+    if(j == i && strcmp(db->defs[i].model, SIGNAL_DEFAULT_MODEL))
+      printf(" %s", db->defs[i].model);
+  }
+  printf("\n");
+}
+
+static struct signal_def *find_def(struct signal_db *db, char *model, char *name) {
+  int i;
+
+  for(i = 0; i < db->count; i++)
+    if(!strcmp(db->defs[i].model, model) && !strcmp(db->defs[i].name, name))
+      return &db->defs[i];
+  return NULL;
+}
+
+struct signal_def *signal_db_find(struct signal_db *db, char *model, char *name) {
+  struct signal_def *def = NULL;
+
+  if(model) def = find_def(db, model, name);
+  if(!def) def = find_def(db, SIGNAL_DEFAULT_MODEL, name);
+  return def;
+}
+
+int signal_layout(struct signal_db *db, char *model, int seed, int fd, struct signal_def *defs) {
+  struct signal_def *def;
+  int i;
+
+  for(i = 0; i < NUM_SIGNALS; i++) {
+    def = signal_db_find(db, model, (char *)signal_names[i]);
+    if(!def) {
+      fprintf(stderr, "Signal %s is not defined in the signal database\n", signal_names[i]);
+      return -1;
+    }
+    defs[i] = *def;
+  }
+  if(seed) {
+    srand(seed);
+    defs[SIGNAL_DOOR].id = (rand() % 2046) + 1;
+    defs[SIGNAL_TURN].id = (rand() % 2046) + 1;
+    defs[SIGNAL_SPEED].id = (rand() % 2046) + 1;
+    if(fd) {
+      // Anywhere in the FD payload, signal_pack_fd() sorts out overlaps
+      defs[SIGNAL_DOOR].byte = rand() % CANFD_MAX_DLEN;
+      defs[SIGNAL_TURN].byte = rand() % CANFD_MAX_DLEN;
+      defs[SIGNAL_SPEED].byte = rand() % (CANFD_MAX_DLEN - 1);
+    } else {
+      defs[SIGNAL_DOOR].byte = rand() % 9;
+      defs[SIGNAL_TURN].byte = rand() % 9;
+      defs[SIGNAL_SPEED].byte = rand() % 8;
+    }
+  }
+  if(fd) signal_pack_fd(defs);
+  return 0;
+}
+
+void signal_pack_fd(struct signal_def *defs) {
+  static const int order[NUM_SIGNALS] = { SIGNAL_SPEED, SIGNAL_TURN, SIGNAL_DOOR };
+  unsigned char used[CANFD_MAX_DLEN] = { 0 };
+  struct signal_def *def;
+  int i, k, n, byte;
+
+  for(i = 0; i < NUM_SIGNALS; i++) {
+    def = &defs[order[i]];
+    def->id = defs[SIGNAL_SPEED].id;
+    n = (def->bit + def->bits + 7) / 8;
+    for(byte = def->byte; ; byte = (byte + 1) % (CANFD_MAX_DLEN - n + 1)) {
+      for(k = 0; k < n && !used[byte + k]; k++);
+      if(k == n) break;
+    }
+    def->byte = byte;
+    for(k = 0; k < n; k++) used[byte + k] = 1;
+  }
+}
+
+void signal_compile(struct signal_def *def, struct signal_plan *plan) {
+  int nbytes = (def->bit + def->bits + 7) / 8;
+  int k;
+
+  memset(plan, 0, sizeof(*plan));
+  plan->id = def->id;
+  plan->min_len = def->byte + nbytes;
+  // Unused slots read byte 0 through a zero mask
+  for(k = 0; k < nbytes; k++) {
+    plan->idx[k] = def->byte + k;
+    plan->bmask[k] = 0xFF;
+    plan->bshift[k] = def->big_endian ? 8 * (nbytes - 1 - k) : 8 * k;
+  }
+  plan->shift = def->bit;
+  plan->mask = def->bits == 32 ? 0xFFFFFFFFU : (1U << def->bits) - 1;
+  plan->scale = def->scale;
+  plan->offset = def->offset;
+}
+
+void signal_encode(const struct signal_plan *p, unsigned char *data, double value) {
+  double r = (value - p->offset) / p->scale + 0.5;
+  uint32_t raw = r <= 0 ? 0 : r >= p->mask ? p->mask : (uint32_t)r;
+  uint32_t word = 0;
+  int k;
+
+  // Read the same slots signal_decode() does and merge the signal in
+  for(k = 0; k < SIGNAL_MAX_BYTES; k++)
+    word |= (uint32_t)(data[p->idx[k]] & p->bmask[k]) << p->bshift[k];
+  word = (word & ~(p->mask << p->shift)) | raw << p->shift;
+  for(k = 0; k < SIGNAL_MAX_BYTES; k++)
+    if(p->bmask[k]) data[p->idx[k]] = word >> p->bshift[k];
+}
@@ -0,0 +1,129 @@
+/*
+ * Signal database
+ *
+ * Signals are described in a text file, one per line:
+ *
+ *   <model> <signal> <can_id> <byte> <bit> <bits> <le|be> <scale> <offset>
+ *
+ * <byte> is the first data byte of the signal, <bit> the position of its
+ * least significant bit in the little or big endian word that starts there
+ * and <bits> its width (bit + bits <= 32).  The decoded value is
+ * raw * scale + offset.  Signals a model doesn't list fall back to the
+ * "default" model.
+ *
+ * Each definition is compiled into a plan so decoding a frame is a fixed
+ * sequence of loads, shifts and masks without any branches.  controls
+ * encodes its frames through the same plans, so both sides always agree
+ * on the layout.
+ */
+
+#ifndef ICSIM_SIGNALS_H
+#define ICSIM_SIGNALS_H
+
+#include <stdint.h>
+#include <linux/can.h>
+
+#define SIGNAL_DEFAULT_MODEL "default"
+#define SIGNAL_NAME_LEN 32
+#define SIGNAL_MAX_BYTES 4
+
+// The signals the cluster shows, in signal_names[] order
+#define SIGNAL_SPEED 0
+#define SIGNAL_TURN 1
+#define SIGNAL_DOOR 2
+#define NUM_SIGNALS 3
+
+extern const char *signal_names[NUM_SIGNALS];
+
+struct signal_def {
+  char model[SIGNAL_NAME_LEN];
+  char name[SIGNAL_NAME_LEN];
+  canid_t id;
+  int byte;
+  int bit;
+  int bits;
+  int big_endian;
+  double scale;
+  double offset;
+};
+
+struct signal_db {
+  struct signal_def *defs;
+  int count;
+};
+
+struct signal_plan {
+  canid_t id;
+  int min_len; // Frames shorter than this don't carry the signal
+  unsigned char idx[SIGNAL_MAX_BYTES]; // Data byte feeding each slot
+  unsigned char bmask[SIGNAL_MAX_BYTES]; // 0 for unused slots
+  unsigned char bshift[SIGNAL_MAX_BYTES]; // Position of the byte in the word
+  unsigned char shift;
+  uint32_t mask;
+  double scale;
+  double offset;
+};
+
+int signal_db_load(struct signal_db *db, char *fname);
+/*
+ * Reads a signal database file.  Empty lines and lines starting with '#'
+ * are ignored.
+ *
+ * Return values:
+ * 0 = success
+ * -1 = error, the offending line is reported on stderr
+ */
+
+void signal_db_free(struct signal_db *db);
+
+int signal_db_has_model(struct signal_db *db, char *model);
+
+void signal_db_print_models(struct signal_db *db);
+/*
+ * Prints the models defined besides the default one on stdout.
+ */
+
+struct signal_def *signal_db_find(struct signal_db *db, char *model, char *name);
+/*
+ * Returns the definition of signal name for model, the default model's if
+ * model doesn't define it, or NULL.  model may be NULL for the default.
+ */
+
+int signal_layout(struct signal_db *db, char *model, int seed, int fd, struct signal_def *defs);
+/*
+ * Fills defs[NUM_SIGNALS] with the cluster's signals for model.  A non
+ * zero seed moves their IDs and byte positions around, drawn from rand()
+ * in a fixed order so icsim and controls given the same seed end up with
+ * the same layout.  With fd the turn signals and doors ride in the speed
+ * frame, see signal_pack_fd().
+ * Returns 0 on success, -1 if a signal isn't defined (reported on stderr).
+ */
+
+void signal_pack_fd(struct signal_def *defs);
+/*
+ * Moves defs[NUM_SIGNALS] into one CAN FD frame on the speed ID.  Signals
+ * are placed in the order speed, signal, door.  One that overlaps bytes
+ * already taken moves up to the next free ones, wrapping around at the
+ * end of the 64 byte payload.
+ */
+
+void signal_compile(struct signal_def *def, struct signal_plan *plan);
+
+void signal_encode(const struct signal_plan *p, unsigned char *data, double value);
+/*
+ * Stores value into a frame's data, the inverse of signal_decode().  It is
+ * rounded to the nearest raw value and clamped to what the signal's bits
+ * hold.  Only the signal's bits are written, the rest of its bytes are
+ * kept.  data must have room for p->min_len bytes.
+ */
+
+/* Extracts the signal from a frame's data, the caller checks min_len */
+static inline double signal_decode(const struct signal_plan *p, const unsigned char *data) {
+  uint32_t raw = ((uint32_t)(data[p->idx[0]] & p->bmask[0]) << p->bshift[0]) |
+                 ((uint32_t)(data[p->idx[1]] & p->bmask[1]) << p->bshift[1]) |
+                 ((uint32_t)(data[p->idx[2]] & p->bmask[2]) << p->bshift[2]) |
+                 ((uint32_t)(data[p->idx[3]] & p->bmask[3]) << p->bshift[3]);
+  return ((raw >> p->shift) & p->mask) * p->scale + p->offset;
+}
+
+#endif
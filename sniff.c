@@ -0,0 +1,171 @@
+/*
+ * Payload change tracker for the sniffer
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "sniff.h"
+#include "dispatch.h"
+
+#define EFF_INITIAL_SIZE 16
+#define ENTRIES_INITIAL_SIZE 256
+
+// len_mask[n] keeps the first n bytes of a payload, the rest is zeroed
+static unsigned char len_mask[CANFD_MAX_DLEN + 1][CANFD_MAX_DLEN] __attribute__((aligned(16)));
+
+static struct sniff_eff_slot *eff_slot(struct sniff *sn, canid_t id) {
+  unsigned int i = dispatch_eff_hash(id, sn->eff_size);
+
+  while(sn->eff[i].id && sn->eff[i].id != id)
+    i = (i + 1) & (sn->eff_size - 1);
+  return &sn->eff[i];
+}
+
+static int eff_grow(struct sniff *sn) {
+  struct sniff_eff_slot *old = sn->eff;
+  unsigned int i, old_size = sn->eff_size;
+
+  sn->eff_size = old_size ? old_size * 2 : EFF_INITIAL_SIZE;
+  sn->eff = calloc(sn->eff_size, sizeof(*sn->eff));
+  if(!sn->eff) {
+    sn->eff = old;
+    sn->eff_size = old_size;
+    return -1;
+  }
+  for(i = 0; i < old_size; i++)
+    if(old[i].id) *eff_slot(sn, old[i].id) = old[i];
+  free(old);
+  return 0;
+}
+
+void sniff_init(struct sniff *sn) {
+  int n;
+
+  memset(sn, 0, sizeof(*sn));
+  if(len_mask[1][0]) return;
+  for(n = 0; n <= CANFD_MAX_DLEN; n++)
+    memset(len_mask[n], 0xFF, n);
+}
+
+void sniff_free(struct sniff *sn) {
+  unsigned int i;
+
+  for(i = 0; i < sn->count; i++) free(sn->entries[i]);
+  free(sn->entries);
+  free(sn->eff);
+  memset(sn, 0, sizeof(*sn));
+}
+
+static struct sniff_entry *new_entry(struct sniff *sn, canid_t id) {
+  struct sniff_entry **entries, *e;
+
+  if(sn->count == sn->size) {
+    entries = realloc(sn->entries, (sn->size ? sn->size * 2 : ENTRIES_INITIAL_SIZE) * sizeof(*entries));
+    if(!entries) return NULL;
+    sn->entries = entries;
+    sn->size = sn->size ? sn->size * 2 : ENTRIES_INITIAL_SIZE;
+  }
+  if(posix_memalign((void **)&e, 16, sizeof(*e))) return NULL;
+  memset(e, 0, sizeof(*e));
+  e->id = id;
+  sn->entries[sn->count++] = e;
+  return e;
+}
+
+static struct sniff_entry *find_entry(struct sniff *sn, canid_t id) {
+  struct sniff_eff_slot *slot;
+
+  if(!(id & CAN_EFF_FLAG)) {
+    id &= CAN_SFF_MASK;
+    if(!sn->sff[id]) sn->sff[id] = new_entry(sn, id);
+    return sn->sff[id];
+  }
+  id &= CAN_EFF_MASK | CAN_EFF_FLAG;
+  if(sn->eff_size) {
+    slot = eff_slot(sn, id);
+    if(slot->id) return slot->e;
+  }
+  // Keep the load factor under 3/4
+  if((sn->eff_count + 1) * 4 > sn->eff_size * 3 && eff_grow(sn) < 0) return NULL;
+  slot = eff_slot(sn, id);
+  slot->e = new_entry(sn, id);
+  if(slot->e) {
+    slot->id = id;
+    sn->eff_count++;
+  }
+  return slot->e;
+}
+
+/* Stores the masked payload and returns a bitmask of the bytes that
+ * changed, their XOR with the old payload goes to x
+ */
+static uint64_t diff_payload(struct sniff_entry *e, const unsigned char *data, int len, int chunks, unsigned char *x) {
+  uint64_t changed = 0;
+  int k;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  __m128i v, d;
+
+  for(k = 0; k < chunks * 16; k += 16) {
+    v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(data + k)), _mm_load_si128((const __m128i *)(len_mask[len] + k)));
+    d = _mm_xor_si128(v, _mm_load_si128((const __m128i *)(e->data + k)));
+    _mm_store_si128((__m128i *)(e->data + k), v);
+    _mm_store_si128((__m128i *)(x + k), d);
+    _mm_store_si128((__m128i *)(e->flips + k), _mm_or_si128(_mm_load_si128((const __m128i *)(e->flips + k)), d));
+    changed |= (uint64_t)(~_mm_movemask_epi8(_mm_cmpeq_epi8(d, zero)) & 0xFFFF) << k;
+  }
+#else
+  unsigned char v;
+
+  for(k = 0; k < chunks * 16; k++) {
+    v = data[k] & len_mask[len][k];
+    x[k] = v ^ e->data[k];
+    e->data[k] = v;
+    e->flips[k] |= x[k];
+    if(x[k]) changed |= 1ULL << k;
+  }
+#endif
+  return changed;
+}
+
+void sniff_frame(struct sniff *sn, struct canfd_frame *cf, int fd) {
+  unsigned char x[CANFD_MAX_DLEN] __attribute__((aligned(16)));
+  struct sniff_entry *e;
+  uint64_t changed;
+  int len, i, b, chunks;
+
+  if(cf->can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG)) return;
+  sn->frames++;
+  e = find_entry(sn, cf->can_id);
+  if(!e) {
+    sn->lost++;
+    return;
+  }
+  len = cf->len > CANFD_MAX_DLEN ? CANFD_MAX_DLEN : cf->len;
+  // Only the 16 byte chunks either payload reaches
+  chunks = ((len > e->len ? len : e->len) + 15) / 16;
+  changed = diff_payload(e, cf->data, len, chunks, x);
+  e->len = len;
+  e->fd = fd;
+  if(!e->frames++) {
+    // The first payload is the baseline, not a change
+    memset(e->flips, 0, sizeof(e->flips));
+    return;
+  }
+  if(!changed) return;
+  e->changes++;
+  for(; changed; changed &= changed - 1) {
+    i = __builtin_ctzll(changed);
+    e->byte_changes[i]++;
+    for(b = x[i]; b; b &= b - 1)
+      e->bit_changes[i * 8 + __builtin_ctz(b)]++;
+  }
+}
+
+void sniff_clear_flips(struct sniff_entry *e) {
+  memset(e->flips, 0, sizeof(e->flips));
+}
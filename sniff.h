@@ -0,0 +1,65 @@
+/*
+ * Payload change tracker for the sniffer
+ *
+ * Keeps the last payload of every CAN ID seen and counts how often each
+ * byte and each bit of it changed.  A frame is diffed against the stored
+ * payload with a vectorized XOR, 16 bytes at a time, so a classic frame
+ * costs one compare and a 64 byte FD frame four.  Only the bytes that
+ * actually changed are then walked to bump their counters.  Bytes past a
+ * frame's length count as zero.
+ *
+ * 11-bit IDs index a direct table, 29-bit ones live in an open addressed
+ * hash, like the dispatch table.
+ */
+
+#ifndef ICSIM_SNIFF_H
+#define ICSIM_SNIFF_H
+
+#include <stdint.h>
+#include <linux/can.h>
+
+struct sniff_entry {
+  unsigned char data[CANFD_MAX_DLEN] __attribute__((aligned(16))); // Last payload
+  unsigned char flips[CANFD_MAX_DLEN] __attribute__((aligned(16))); // Bits changed since sniff_clear_flips()
+  canid_t id; // EFF IDs carry CAN_EFF_FLAG
+  int len; // Of the last frame
+  int fd; // Last frame was CAN FD
+  unsigned long frames;
+  unsigned long changes; // Frames that changed the payload
+  unsigned long shown_frames; // frames when the entry was last drawn
+  uint32_t byte_changes[CANFD_MAX_DLEN];
+  uint32_t bit_changes[CANFD_MAX_DLEN * 8]; // Byte * 8 + bit, bit 0 = LSB
+};
+
+struct sniff_eff_slot {
+  canid_t id; // 0 = empty
+  struct sniff_entry *e;
+};
+
+struct sniff {
+  struct sniff_entry *sff[CAN_SFF_MASK + 1];
+  struct sniff_eff_slot *eff;
+  unsigned int eff_size; // Power of two
+  unsigned int eff_count; // IDs in the hash, count includes the 11-bit ones
+  struct sniff_entry **entries; // In the order they were first seen
+  unsigned int count;
+  unsigned int size;
+  unsigned long frames;
+  unsigned long lost; // Frames not tracked because we ran out of memory
+};
+
+void sniff_init(struct sniff *sn);
+void sniff_free(struct sniff *sn);
+
+void sniff_frame(struct sniff *sn, struct canfd_frame *cf, int fd);
+/*
+ * Records a received frame.  fd tells CAN FD frames apart from classic
+ * ones of the same length.  RTR and error frames are ignored.
+ */
+
+void sniff_clear_flips(struct sniff_entry *e);
+/*
+ * Forgets which bits changed, call after drawing the entry.
+ */
+
+#endif
@@ -0,0 +1,287 @@
+/*
+ * Byte change sniffer, shows which bytes of each CAN ID change
+ */
+
+#define _GNU_SOURCE // recvmmsg()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "capture.h"
+#include "sniff.h"
+#include "timeutil.h"
+
+#define RX_BATCH 64 // Max frames pulled per recvmmsg() call
+#define RX_MAX_BATCHES 256 // Then redraw if it's due, even if more is queued
+#define RCVBUF_SIZE (4 << 20) // Room for a 100x replay burst between two reads
+#define DEFAULT_REFRESH_MS 200
+
+#define COLOR_NOW "\033[1;31m" // Changed since the last refresh
+#define COLOR_EVER "\033[33m" // Changed before
+#define COLOR_OFF "\033[0m"
+
+char *replay_file = NULL;
+int refresh_ms = DEFAULT_REFRESH_MS;
+int bit_view = 0;
+int changed_only = 0;
+int color = 0;
+volatile sig_atomic_t running = 1;
+
+void stop_sniffing(int sig) {
+  (void)sig;
+  running = 0;
+}
+
+int cmp_entry(const void *a, const void *b) {
+  const struct sniff_entry *x = *(struct sniff_entry * const *)a;
+  const struct sniff_entry *y = *(struct sniff_entry * const *)b;
+
+  return x->id < y->id ? -1 : x->id > y->id;
+}
+
+void print_byte(struct sniff_entry *e, int i) {
+  if(color && e->flips[i]) printf(COLOR_NOW "%02X" COLOR_OFF, e->data[i]);
+  else if(color && e->byte_changes[i]) printf(COLOR_EVER "%02X" COLOR_OFF, e->data[i]);
+  else printf("%02X", e->data[i]);
+}
+
+/* Bits MSB first, like the bytes read */
+void print_bits(struct sniff_entry *e, int i) {
+  int b, bit;
+
+  for(b = 7; b >= 0; b--) {
+    bit = '0' + ((e->data[i] >> b) & 1);
+    if(color && (e->flips[i] >> b) & 1) printf(COLOR_NOW "%c" COLOR_OFF, bit);
+    else if(color && e->bit_changes[i * 8 + b]) printf(COLOR_EVER "%c" COLOR_OFF, bit);
+    else putchar(bit);
+  }
+}
+
+/* Draws the table, one row per ID sorted by ID.  secs is the time since
+ * the last refresh, for the frame rate, 0 leaves the rate out.
+ */
+void draw(struct sniff *sn, double secs, unsigned long drops) {
+  struct sniff_entry **rows, *e;
+  // Clear what's left of the previous, longer row on a terminal only
+  const char *eol = color ? "\033[K\n" : "\n";
+  unsigned int i, n = 0;
+  int j;
+
+  rows = malloc(sn->count * sizeof(*rows));
+  if(!rows) return;
+  for(i = 0; i < sn->count; i++)
+    if(!changed_only || sn->entries[i]->changes) rows[n++] = sn->entries[i];
+  qsort(rows, n, sizeof(*rows), cmp_entry);
+  if(color) printf("\033[H");
+  printf("%u IDs, %lu frames, %lu dropped%s", sn->count, sn->frames, drops, eol);
+  printf("      ID len   frames/s  changes  data%s", eol);
+  for(i = 0; i < n; i++) {
+    e = rows[i];
+    if(e->id & CAN_EFF_FLAG) printf("%08X", e->id & CAN_EFF_MASK);
+    else printf("     %03X", e->id);
+    printf(" %2d%c", e->len, e->fd ? '*' : ' ');
+    if(secs > 0) printf(" %10.1f", (e->frames - e->shown_frames) / secs);
+    else printf(" %10s", "-");
+    printf(" %8lu ", e->changes);
+    for(j = 0; j < e->len; j++) {
+      putchar(' ');
+      if(bit_view) print_bits(e, j);
+      else print_byte(e, j);
+    }
+    fputs(eol, stdout);
+    e->shown_frames = e->frames;
+    sniff_clear_flips(e);
+  }
+  if(color) printf("\033[J");
+  fflush(stdout);
+  free(rows);
+}
+
+int open_can(char *ifname) {
+  struct ifreq ifr;
+  struct sockaddr_can addr;
+  int s, on = 1, rcvbuf = RCVBUF_SIZE;
+
+  s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if(s < 0) {
+    perror("socket");
+    exit(1);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  memset(&ifr.ifr_name, 0, sizeof(ifr.ifr_name));
+  strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+  if (ioctl(s, SIOCGIFINDEX, &ifr) < 0) {
+    perror("SIOCGIFINDEX");
+    exit(1);
+  }
+  addr.can_ifindex = ifr.ifr_ifindex;
+  setsockopt(s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &on, sizeof(on));
+  if(setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0)
+    perror("setsockopt SO_RXQ_OVFL");
+  // Past rmem_max only with CAP_NET_ADMIN, else take what we can get
+  if(setsockopt(s, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    exit(1);
+  }
+  return s;
+}
+
+/* Sniffs live until interrupted, drawing every refresh_ms */
+int sniff_live(struct sniff *sn, char *ifname) {
+  struct canfd_frame frames[RX_BATCH];
+  struct iovec iovs[RX_BATCH];
+  struct mmsghdr msgs[RX_BATCH];
+  char ctrlmsgs[RX_BATCH][CMSG_SPACE(sizeof(__u32))];
+  struct cmsghdr *cmsg;
+  struct pollfd pfd;
+  uint64_t now, last_draw, next_draw;
+  unsigned long drops = 0;
+  __u32 dropcnt, last_dropcnt = 0;
+  int s, i, n, batches, timeout;
+
+  s = open_can(ifname);
+  memset(msgs, 0, sizeof(msgs));
+  for(i = 0; i < RX_BATCH; i++) {
+    iovs[i].iov_base = &frames[i];
+    iovs[i].iov_len = sizeof(frames[i]);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = ctrlmsgs[i];
+  }
+  if(color) printf("\033[2J");
+  pfd.fd = s;
+  pfd.events = POLLIN;
+  last_draw = mono_ns();
+  next_draw = last_draw + refresh_ms * 1000000ULL;
+  while(running) {
+    now = mono_ns();
+    timeout = next_draw > now ? (next_draw - now + 999999) / 1000000 : 0;
+    if(poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+      perror("poll");
+      return 1;
+    }
+    // Drain what's queued, the socket buffer covers the time spent drawing
+    for(batches = 0; running && batches < RX_MAX_BATCHES; batches++) {
+      for(i = 0; i < RX_BATCH; i++) {
+        msgs[i].msg_hdr.msg_controllen = sizeof(ctrlmsgs[i]);
+        msgs[i].msg_hdr.msg_flags = 0;
+      }
+      n = recvmmsg(s, msgs, RX_BATCH, MSG_DONTWAIT, NULL);
+      if(n < 0) {
+        if(errno == EAGAIN || errno == EINTR) break;
+        perror("recvmmsg");
+        return 1;
+      }
+      for(i = 0; i < n; i++) {
+        if(msgs[i].msg_len != CAN_MTU && msgs[i].msg_len != CANFD_MTU) continue;
+        for(cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+          if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SO_RXQ_OVFL) continue;
+          memcpy(&dropcnt, CMSG_DATA(cmsg), sizeof(dropcnt));
+          // The socket's running total, only sent once it's non zero
+          if(dropcnt != last_dropcnt) {
+            drops += (__u32)(dropcnt - last_dropcnt);
+            last_dropcnt = dropcnt;
+          }
+        }
+        sniff_frame(sn, &frames[i], msgs[i].msg_len == CANFD_MTU);
+      }
+      if(n < RX_BATCH) break;
+    }
+    now = mono_ns();
+    if(now >= next_draw) {
+      draw(sn, (now - last_draw) / 1e9, drops);
+      last_draw = now;
+      next_draw = now + refresh_ms * 1000000ULL;
+    }
+  }
+  close(s);
+  printf("Sniffed %lu frames, %u IDs, %lu dropped by the kernel\n", sn->frames, sn->count, drops);
+  return 0;
+}
+
+/* Runs a capture or candump log through the tracker as fast as it goes
+ * and draws the result once
+ */
+int sniff_file(struct sniff *sn, char *fname) {
+  struct cap_file cap;
+  uint64_t i, t0, elapsed;
+
+  if(cap_open(&cap, fname) < 0) return 1;
+  t0 = mono_ns();
+  for(i = 0; i < cap.count; i++)
+    sniff_frame(sn, &cap.records[i].cf, cap_mtu(&cap.records[i]) == CANFD_MTU);
+  elapsed = mono_ns() - t0;
+  // There is no last refresh, changed bytes all show as changed before
+  for(i = 0; i < sn->count; i++)
+    sniff_clear_flips(sn->entries[i]);
+  draw(sn, 0, 0);
+  fprintf(stderr, "Sniffed %lu frames in %.3f s: %.0f frames/s, %u IDs\n",
+          (unsigned long)cap.count, elapsed / 1e9, elapsed ? cap.count * 1e9 / elapsed : 0, sn->count);
+  cap_close(&cap);
+  return 0;
+}
+
+void usage(char *msg) {
+  if(msg) printf("%s\n", msg);
+  printf("Usage: sniffer [options] <can>\n");
+  printf("       sniffer [options] -r <file>\n");
+  printf("Shows the last payload of every CAN ID, highlighting the bytes that change\n");
+  printf("\t-r\tread a capture or candump log instead, as fast as possible\n");
+  printf("\t-i\trefresh interval in ms (default: %d)\n", DEFAULT_REFRESH_MS);
+  printf("\t-b\tshow bits instead of bytes\n");
+  printf("\t-c\tonly show IDs whose payload changed\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  struct sniff sn;
+  int opt, ret;
+
+  while ((opt = getopt(argc, argv, "r:i:bch?")) != -1) {
+    switch(opt) {
+	case 'r':
+		replay_file = optarg;
+		break;
+	case 'i':
+		refresh_ms = atoi(optarg);
+		if(refresh_ms <= 0) usage("Refresh interval must be positive");
+		break;
+	case 'b':
+		bit_view = 1;
+		break;
+	case 'c':
+		changed_only = 1;
+		break;
+	case 'h':
+	case '?':
+	default:
+		usage(NULL);
+		break;
+    }
+  }
+  if(!replay_file && optind + 1 != argc) usage("You must specify one CAN interface");
+  if(replay_file && optind != argc) usage("-r takes no CAN interface");
+  color = isatty(STDOUT_FILENO);
+
+  signal(SIGINT, stop_sniffing);
+  signal(SIGTERM, stop_sniffing);
+  sniff_init(&sn);
+  if(replay_file) ret = sniff_file(&sn, replay_file);
+  else ret = sniff_live(&sn, argv[optind]);
+  sniff_free(&sn);
+  return ret;
+}
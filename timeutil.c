@@ -0,0 +1,39 @@
+/*
+ * Monotonic clock helpers shared by the background threads
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+
+#include "timeutil.h"
+
+uint64_t mono_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int wait_until(int timer_fd, int stop_fd, uint64_t target) {
+  struct itimerspec its;
+  struct pollfd fds[2];
+  uint64_t expirations;
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = target / 1000000000ULL;
+  its.it_value.tv_nsec = target % 1000000000ULL;
+  timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+  fds[0].fd = timer_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = stop_fd;
+  fds[1].events = POLLIN;
+  while(poll(fds, 2, -1) < 0 && errno == EINTR);
+  if(fds[1].revents) return -1;
+  if(fds[0].revents && read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+    // Nothing to do with the count
+  }
+  return 0;
+}
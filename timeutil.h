@@ -0,0 +1,23 @@
+/*
+ * Monotonic clock helpers shared by the background threads
+ */
+
+#ifndef ICSIM_TIMEUTIL_H
+#define ICSIM_TIMEUTIL_H
+
+#include <stdint.h>
+
+uint64_t mono_ns();
+/*
+ * Returns CLOCK_MONOTONIC in nanoseconds, the clock the timerfds use.
+ */
+
+int wait_until(int timer_fd, int stop_fd, uint64_t target);
+/*
+ * Arms timer_fd (a CLOCK_MONOTONIC timerfd) for the absolute time target
+ * and sleeps until it expires or stop_fd (an eventfd) becomes readable.
+ * stop_fd is left set so every later wait returns at once as well.
+ * Returns 0 once target is reached, -1 if asked to stop meanwhile.
+ */
+
+#endif